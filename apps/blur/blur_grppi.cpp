@@ -28,6 +28,24 @@
 #include <chrono>
 #include <cstdlib>
 #include <numeric>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <experimental/optional>
+#include <cstdint>
+#include <type_traits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_X86_SIMD
+#endif
 #include "grppi.h"
 #include "dyn/dynamic_execution.h"
 
@@ -60,6 +78,1174 @@ auto blur(std::vector<unsigned char> frame, int frame_cols,
   return std::move(result);
 }
 
+// Applies op to every index in [0, size) through the GrPPI map pattern
+template <typename Op>
+void map_index(int size, Op && op, const grppi::dynamic_execution& exec)
+{
+  std::vector<int> index(size);
+  std::iota(index.begin(), index.end(), 0);
+  grppi::map(exec, index.begin(), index.end(), index.begin(),
+    [&](int i) { op(i); return i; });
+}
+
+// Planar channels of one frame: read-only views of the input channels and
+// the caller-provided output buffers, all of rows x cols pixels
+struct channel_views {
+  std::vector<const unsigned char *> in;
+  std::vector<unsigned char *> out;
+  int rows;
+  int cols;
+};
+
+// Convolution kernel: the 1D taps and the 2D kernel built as their outer
+// product, of cols x cols elements. A kernel with a sigma is instead a
+// recursive Gaussian, and cols is then its effective support. A kernel
+// with a rank radius is a percentile filter over a square window of cols
+// = 2 rank_radius + 1.
+struct blur_kernel {
+  std::string name;
+  std::vector<int> taps;
+  std::vector<int> kernel;
+  int cols;
+  double sigma = 0;
+  int rank_radius = 0;
+  double percentile = 50;
+};
+
+// True for the kernels convolved through their taps
+bool is_convolution(const blur_kernel& kernel)
+{
+  return (kernel.sigma == 0) && (kernel.rank_radius == 0);
+}
+
+// Sum of the taps that fall inside [0, size) when centered at each position
+std::vector<int> border_weights(int size, const std::vector<int>& taps)
+{
+  int radius = taps.size() / 2;
+  std::vector<int> weights(size, 0);
+  for (int pos = 0; pos < size; pos++)
+    for (int k = 0; k < taps.size(); k++)
+      if ((pos+k-radius >= 0) && (pos+k-radius < size))
+        weights[pos] += taps[k];
+  return weights;
+}
+
+// Rows of the vertical pass of the separable engine that share one
+// accumulator row
+constexpr int separable_chunk_rows = 16;
+
+// Separable blur: a horizontal and a vertical pass with the 1D kernel taps.
+// Taps falling outside the image are dropped and the weight renormalised.
+// Each pass traverses the rows of all the channels at once.
+void blur_separable(const channel_views& frame, const std::vector<int>& taps,
+                    const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int radius = taps.size() / 2;
+  auto col_weight = border_weights(frame.cols, taps);
+  auto row_weight = border_weights(frame.rows, taps);
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  std::vector<int> partial(channels * plane);
+
+  // horizontal pass: unnormalised sums into the intermediate buffer
+  map_index(channels * frame.rows, [&](int task) {
+    int channel = task / frame.rows, row = task % frame.rows;
+    auto in = frame.in[channel] + row * frame.cols;
+    auto out = partial.data() + channel * plane + row * frame.cols;
+    for (int col = 0; col < frame.cols; col++) {
+      int first = std::max(0, radius - col);
+      int last = std::min<int>(taps.size(), frame.cols - col + radius);
+      int value = 0;
+      for (int k = first; k < last; k++)
+        value += in[col+k-radius] * taps[k];
+      out[col] = value;
+    }
+  }, exec);
+
+  // vertical pass: accumulate whole rows of partial sums and normalise,
+  // reusing one accumulator row for every row of a chunk
+  int chunks = (frame.rows + separable_chunk_rows - 1) / separable_chunk_rows;
+  map_index(channels * chunks, [&](int task) {
+    int channel = task / chunks;
+    int first_row = (task % chunks) * separable_chunk_rows;
+    int last_row = std::min(first_row + separable_chunk_rows, frame.rows);
+    std::vector<int> value(frame.cols);
+    for (int row = first_row; row < last_row; row++) {
+      int first = std::max(0, radius - row);
+      int last = std::min<int>(taps.size(), frame.rows - row + radius);
+      std::fill(value.begin(), value.end(), 0);
+      for (int k = first; k < last; k++) {
+        auto in = partial.data() + channel * plane + (row+k-radius) * frame.cols;
+        for (int col = 0; col < frame.cols; col++)
+          value[col] += in[col] * taps[k];
+      }
+      auto out = frame.out[channel] + row * frame.cols;
+      for (int col = 0; col < frame.cols; col++)
+        out[col] = (unsigned char) (value[col] / (row_weight[row] * col_weight[col]));
+    }
+  }, exec);
+}
+
+// Tile dimensions for the tiled engine, sized so that a tile plus its
+// halo stays resident in the L2 cache
+constexpr int tile_rows = 64, tile_cols = 256;
+
+// Applies the full kernel to one border pixel, dropping the taps that
+// fall outside the image and renormalising the weight
+unsigned char blur_border_pixel(const unsigned char * frame,
+                                int frame_rows, int frame_cols,
+                                const std::vector<int>& kernel, int kernel_cols,
+                                int row, int col)
+{
+  int radius = kernel_cols / 2;
+  int first_row = std::max(0, radius - row);
+  int last_row = std::min(kernel_cols, frame_rows - row + radius);
+  int first_col = std::max(0, radius - col);
+  int last_col = std::min(kernel_cols, frame_cols - col + radius);
+  int weight = 0;
+  int value = 0;
+  for (int i = first_row; i < last_row; i++) {
+    auto in = frame + (row+i-radius) * frame_cols + (col-radius);
+    for (int j = first_col; j < last_col; j++) {
+      value += in[j] * kernel[i*kernel_cols+j];
+      weight += kernel[i*kernel_cols+j];
+    }
+  }
+  return (unsigned char) (value / weight);
+}
+
+// Tiled blur: the tiles of all the channels are distributed through the
+// GrPPI execution. Pixels whose whole neighbourhood lies inside the image
+// run without bounds checks; the border band of kernel_cols/2 pixels is
+// handled apart.
+void blur_tiled(const channel_views& frame,
+                const std::vector<int>& kernel, int kernel_cols,
+                const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int radius = kernel_cols / 2;
+  int weight = std::accumulate(kernel.begin(), kernel.end(), 0);
+  std::vector<int> offset;
+  for(int k = 0; k < kernel.size(); k++)
+    offset.push_back(((k/kernel_cols-radius) * frame.cols) + (k%kernel_cols-radius));
+
+  int tiles_down = (frame.rows + tile_rows - 1) / tile_rows;
+  int tiles_across = (frame.cols + tile_cols - 1) / tile_cols;
+  int tiles = tiles_down * tiles_across;
+
+  map_index(channels * tiles, [&](int task) {
+    int channel = task / tiles, tile = task % tiles;
+    auto frame_in = frame.in[channel];
+    int first_row = (tile / tiles_across) * tile_rows;
+    int last_row = std::min(first_row + tile_rows, frame.rows);
+    int first_col = (tile % tiles_across) * tile_cols;
+    int last_col = std::min(first_col + tile_cols, frame.cols);
+    // columns of the tile whose neighbourhood does not cross the border
+    int inner_first = std::max(first_col, radius);
+    int inner_last = std::max(inner_first, std::min(last_col, frame.cols - radius));
+
+    for (int row = first_row; row < last_row; row++) {
+      auto out = frame.out[channel] + row * frame.cols;
+      if ((row < radius) || (row >= frame.rows - radius)) {
+        for (int col = first_col; col < last_col; col++)
+          out[col] = blur_border_pixel(frame_in, frame.rows, frame.cols,
+                                       kernel, kernel_cols, row, col);
+        continue;
+      }
+      for (int col = first_col; col < inner_first; col++)
+        out[col] = blur_border_pixel(frame_in, frame.rows, frame.cols,
+                                     kernel, kernel_cols, row, col);
+      for (int col = inner_first; col < inner_last; col++) {
+        auto in = frame_in + row * frame.cols + col;
+        int value = 0;
+        for (int k = 0; k < kernel.size(); k++)
+          value += in[offset[k]] * kernel[k];
+        out[col] = (unsigned char) (value / weight);
+      }
+      for (int col = inner_last; col < last_col; col++)
+        out[col] = blur_border_pixel(frame_in, frame.rows, frame.cols,
+                                     kernel, kernel_cols, row, col);
+    }
+  }, exec);
+}
+
+// Fixed-point reciprocal: (value * multiplier) >> shift == value / divisor
+// for every value in [0, 2^bits)
+struct reciprocal {
+  std::uint64_t multiplier;
+  int shift;
+};
+
+reciprocal make_reciprocal(int divisor, int bits)
+{
+  int log2_divisor = 0;
+  while ((1ll << log2_divisor) < divisor) log2_divisor++;
+  int shift = bits + log2_divisor;
+  return { ((std::uint64_t) 1 << shift) / divisor + 1, shift };
+}
+
+// Row kernels of the SIMD engine. The horizontal kernel computes the
+// unnormalised sums for the columns [first, last) of one row, which must
+// not reach the border. The vertical kernel accumulates kernel rows of
+// partial sums (starting at the top row of the window) for the columns
+// [first, last) and normalises them with the interior reciprocal.
+struct blur_row_kernels {
+  const char * name;
+  void (*horizontal)(const unsigned char * in, int * out, int first, int last,
+                     const int * taps, int kernel_cols);
+  void (*vertical)(const int * in, int stride, unsigned char * out,
+                   int first, int last, const int * taps, int kernel_cols,
+                   reciprocal weight);
+};
+
+// The row kernels are templates on the kernel width and taps, so the
+// common kernels get fully unrolled loops with the taps kept in registers
+// or folded into the code. Width 0 and null taps take the runtime values.
+template <int Width, const int * Taps>
+struct fixed_kernel {
+  static int cols(int kernel_cols) { return Width ? Width : kernel_cols; }
+  static int tap(const int * taps, int k)
+  {
+    return tap(taps, k, std::integral_constant<bool, Taps != nullptr>{});
+  }
+  static int tap(const int *, int k, std::true_type) { return Taps[k]; }
+  static int tap(const int * taps, int k, std::false_type) { return taps[k]; }
+};
+
+template <int Width = 0, const int * Taps = nullptr>
+void horizontal_scalar(const unsigned char * in, int * out, int first, int last,
+                       const int * taps, int kernel_cols)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  int radius = kernel_cols / 2;
+  for (int col = first; col < last; col++) {
+    int value = 0;
+    for (int k = 0; k < kernel_cols; k++)
+      value += in[col+k-radius] * fixed::tap(taps, k);
+    out[col] = value;
+  }
+}
+
+template <int Width = 0, const int * Taps = nullptr>
+void vertical_scalar(const int * in, int stride, unsigned char * out,
+                     int first, int last, const int * taps, int kernel_cols,
+                     reciprocal weight)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  for (int col = first; col < last; col++) {
+    int value = 0;
+    for (int k = 0; k < kernel_cols; k++)
+      value += in[k*stride+col] * fixed::tap(taps, k);
+    out[col] = (unsigned char) ((value * weight.multiplier) >> weight.shift);
+  }
+}
+
+#ifdef BLUR_X86_SIMD
+template <int Width = 0, const int * Taps = nullptr>
+__attribute__((target("sse4.1")))
+void horizontal_sse41(const unsigned char * in, int * out, int first, int last,
+                      const int * taps, int kernel_cols)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  int radius = kernel_cols / 2;
+  int col = first;
+  for (; col + 4 <= last; col += 4) {
+    __m128i value = _mm_setzero_si128();
+    for (int k = 0; k < kernel_cols; k++) {
+      int pixels;
+      std::memcpy(&pixels, in + col + k - radius, sizeof(pixels));
+      __m128i wide = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixels));
+      value = _mm_add_epi32(value,
+        _mm_mullo_epi32(wide, _mm_set1_epi32(fixed::tap(taps, k))));
+    }
+    _mm_storeu_si128((__m128i*) (out + col), value);
+  }
+  horizontal_scalar<Width, Taps>(in, out, col, last, taps, kernel_cols);
+}
+
+template <int Width = 0, const int * Taps = nullptr>
+__attribute__((target("sse4.1")))
+void vertical_sse41(const int * in, int stride, unsigned char * out,
+                    int first, int last, const int * taps, int kernel_cols,
+                    reciprocal weight)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  __m128i multiplier = _mm_set1_epi64x(weight.multiplier);
+  int col = first;
+  for (; col + 4 <= last; col += 4) {
+    __m128i value = _mm_setzero_si128();
+    for (int k = 0; k < kernel_cols; k++) {
+      __m128i partial = _mm_loadu_si128((const __m128i*) (in + k*stride + col));
+      value = _mm_add_epi32(value,
+        _mm_mullo_epi32(partial, _mm_set1_epi32(fixed::tap(taps, k))));
+    }
+    // 64-bit products of the even and odd lanes, shifted back to 32 bits
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(value, multiplier), weight.shift);
+    __m128i odd = _mm_srli_epi64(
+      _mm_mul_epu32(_mm_srli_epi64(value, 32), multiplier), weight.shift);
+    __m128i quotient = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+    __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(quotient, quotient),
+                                     _mm_setzero_si128());
+    int pixels = _mm_cvtsi128_si32(bytes);
+    std::memcpy(out + col, &pixels, sizeof(pixels));
+  }
+  vertical_scalar<Width, Taps>(in, stride, out, col, last, taps, kernel_cols, weight);
+}
+
+template <int Width = 0, const int * Taps = nullptr>
+__attribute__((target("avx2")))
+void horizontal_avx2(const unsigned char * in, int * out, int first, int last,
+                     const int * taps, int kernel_cols)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  int radius = kernel_cols / 2;
+  int col = first;
+  for (; col + 8 <= last; col += 8) {
+    __m256i value = _mm256_setzero_si256();
+    for (int k = 0; k < kernel_cols; k++) {
+      __m128i pixels = _mm_loadl_epi64((const __m128i*) (in + col + k - radius));
+      __m256i wide = _mm256_cvtepu8_epi32(pixels);
+      value = _mm256_add_epi32(value,
+        _mm256_mullo_epi32(wide, _mm256_set1_epi32(fixed::tap(taps, k))));
+    }
+    _mm256_storeu_si256((__m256i*) (out + col), value);
+  }
+  horizontal_scalar<Width, Taps>(in, out, col, last, taps, kernel_cols);
+}
+
+template <int Width = 0, const int * Taps = nullptr>
+__attribute__((target("avx2")))
+void vertical_avx2(const int * in, int stride, unsigned char * out,
+                   int first, int last, const int * taps, int kernel_cols,
+                   reciprocal weight)
+{
+  using fixed = fixed_kernel<Width, Taps>;
+  kernel_cols = fixed::cols(kernel_cols);
+  __m256i multiplier = _mm256_set1_epi64x(weight.multiplier);
+  int col = first;
+  for (; col + 8 <= last; col += 8) {
+    __m256i value = _mm256_setzero_si256();
+    for (int k = 0; k < kernel_cols; k++) {
+      __m256i partial = _mm256_loadu_si256((const __m256i*) (in + k*stride + col));
+      value = _mm256_add_epi32(value,
+        _mm256_mullo_epi32(partial, _mm256_set1_epi32(fixed::tap(taps, k))));
+    }
+    // 64-bit products of the even and odd lanes, shifted back to 32 bits
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(value, multiplier), weight.shift);
+    __m256i odd = _mm256_srli_epi64(
+      _mm256_mul_epu32(_mm256_srli_epi64(value, 32), multiplier), weight.shift);
+    __m256i quotient = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+    // pack within each 128-bit lane, then join the two 4-byte halves
+    __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(quotient, quotient),
+                                        _mm256_setzero_si256());
+    __m128i pixels = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes),
+                                        _mm256_extracti128_si256(bytes, 1));
+    _mm_storel_epi64((__m128i*) (out + col), pixels);
+  }
+  vertical_scalar<Width, Taps>(in, stride, out, col, last, taps, kernel_cols, weight);
+}
+#endif
+
+// Picks the widest row kernels supported by the running processor
+template <int Width = 0, const int * Taps = nullptr>
+blur_row_kernels make_row_kernels()
+{
+#ifdef BLUR_X86_SIMD
+  if (__builtin_cpu_supports("avx2")) 
+    return { "avx2", horizontal_avx2<Width, Taps>, vertical_avx2<Width, Taps> };
+  if (__builtin_cpu_supports("sse4.1")) 
+    return { "sse4.1", horizontal_sse41<Width, Taps>, vertical_sse41<Width, Taps> };
+#endif
+  return { "scalar", horizontal_scalar<Width, Taps>, vertical_scalar<Width, Taps> };
+}
+
+// Taps of the bundled kernel files
+constexpr int avg3_taps[] = { 1, 1, 1 };
+constexpr int avg5_taps[] = { 1, 1, 1, 1, 1 };
+constexpr int avg7_taps[] = { 1, 1, 1, 1, 1, 1, 1 };
+constexpr int gauss5_taps[] = { 1, 4, 7, 4, 1 };
+
+// Generic row kernels, for any kernel width
+blur_row_kernels select_row_kernels()
+{
+  return make_row_kernels<>();
+}
+
+// Row kernels specialised for the taps: the bundled kernels get their
+// weights compiled in, other kernels of width 3, 5, 7 or 9 get unrolled
+// loops and the rest fall back to the generic kernels
+blur_row_kernels select_row_kernels(const std::vector<int>& taps)
+{
+  auto bundled = [&](const int * kernel, std::size_t size) {
+    return (taps.size() == size) && std::equal(taps.begin(), taps.end(), kernel);
+  };
+  if (bundled(avg3_taps, 3)) return make_row_kernels<3, avg3_taps>();
+  if (bundled(avg5_taps, 5)) return make_row_kernels<5, avg5_taps>();
+  if (bundled(avg7_taps, 7)) return make_row_kernels<7, avg7_taps>();
+  if (bundled(gauss5_taps, 5)) return make_row_kernels<5, gauss5_taps>();
+  switch (taps.size()) {
+    case 3: return make_row_kernels<3>();
+    case 5: return make_row_kernels<5>();
+    case 7: return make_row_kernels<7>();
+    case 9: return make_row_kernels<9>();
+    default: return select_row_kernels();
+  }
+}
+
+// Reciprocal of the weight shared by the pixels away from the border
+reciprocal interior_reciprocal(const std::vector<int>& taps)
+{
+  int weight = std::accumulate(taps.begin(), taps.end(), 0);
+  weight *= weight;
+  int bits = 0;
+  while ((1ll << bits) <= 255ll * weight) bits++;
+  return make_reciprocal(weight, bits);
+}
+
+// SIMD blur: the separable engine with vectorised interior rows and
+// columns. Border pixels keep the clamped, renormalised scalar path. The
+// unrolled engine runs it with the row kernels specialised for the taps.
+void blur_simd(const channel_views& frame, const std::vector<int>& taps,
+               const blur_row_kernels& kernels, const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int kernel_cols = taps.size();
+  int radius = kernel_cols / 2;
+  auto col_weight = border_weights(frame.cols, taps);
+  auto row_weight = border_weights(frame.rows, taps);
+
+  // interior pixels share one weight, divided through its reciprocal
+  auto interior = interior_reciprocal(taps);
+
+  // columns whose horizontal window does not cross the border
+  int inner_first = std::min(radius, frame.cols);
+  int inner_last = std::max(inner_first, frame.cols - radius);
+
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  std::vector<int> partial(channels * plane);
+
+  // horizontal pass: unnormalised sums into the intermediate buffer
+  map_index(channels * frame.rows, [&](int task) {
+    int channel = task / frame.rows, row = task % frame.rows;
+    auto in = frame.in[channel] + row * frame.cols;
+    auto out = partial.data() + channel * plane + row * frame.cols;
+    auto border = [&](int col) {
+      int first = std::max(0, radius - col);
+      int last = std::min(kernel_cols, frame.cols - col + radius);
+      int value = 0;
+      for (int k = first; k < last; k++)
+        value += in[col+k-radius] * taps[k];
+      out[col] = value;
+    };
+    for (int col = 0; col < inner_first; col++) border(col);
+    kernels.horizontal(in, out, inner_first, inner_last, taps.data(), kernel_cols);
+    for (int col = inner_last; col < frame.cols; col++) border(col);
+  }, exec);
+
+  // vertical pass: interior rows go through the row kernel
+  map_index(channels * frame.rows, [&](int task) {
+    int channel = task / frame.rows, row = task % frame.rows;
+    int first = std::max(0, radius - row);
+    int last = std::min(kernel_cols, frame.rows - row + radius);
+    auto in = partial.data() + channel * plane;
+    auto out = frame.out[channel] + row * frame.cols;
+    auto border = [&](int col) {
+      int value = 0;
+      for (int k = first; k < last; k++)
+        value += in[(row+k-radius) * frame.cols + col] * taps[k];
+      out[col] = (unsigned char) (value / (row_weight[row] * col_weight[col]));
+    };
+    if ((row < radius) || (row >= frame.rows - radius)) {
+      for (int col = 0; col < frame.cols; col++) border(col);
+      return;
+    }
+    for (int col = 0; col < inner_first; col++) border(col);
+    kernels.vertical(in + (row-radius) * frame.cols, frame.cols, out,
+                     inner_first, inner_last, taps.data(), kernel_cols, interior);
+    for (int col = inner_last; col < frame.cols; col++) border(col);
+  }, exec);
+}
+
+// Output tile side of the multi-pass engine. Every tile is extended by the
+// radii of all the kernels, so all the passes run on cache-resident data.
+constexpr int multipass_tile = 128;
+
+// Rectangle [top, bottom) x [left, right) in image coordinates
+struct region {
+  int top, bottom, left, right;
+  int rows() const { return bottom - top; }
+  int cols() const { return right - left; }
+};
+
+// Multi-pass blur with overlapped tiling: every output tile is computed
+// from an input area grown by the radius of every kernel, applying all the
+// passes in a row before moving to the next tile. Each pass runs the
+// specialised SIMD row kernels, drops the taps outside the image and rounds
+// to 8 bits, so the result equals running the separable engine per kernel.
+void blur_multipass(const channel_views& frame, const std::vector<blur_kernel>& kernels,
+                    const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int passes = kernels.size();
+  std::vector<std::vector<int>> row_weight, col_weight;
+  std::vector<reciprocal> interior;
+  std::vector<blur_row_kernels> row_kernels;
+  for (auto & k : kernels) {
+    row_kernels.push_back(select_row_kernels(k.taps));
+    row_weight.push_back(border_weights(frame.rows, k.taps));
+    col_weight.push_back(border_weights(frame.cols, k.taps));
+    interior.push_back(interior_reciprocal(k.taps));
+  }
+
+  int tiles_down = (frame.rows + multipass_tile - 1) / multipass_tile;
+  int tiles_across = (frame.cols + multipass_tile - 1) / multipass_tile;
+  int tiles = tiles_down * tiles_across;
+
+  map_index(channels * tiles, [&](int task) {
+    int channel = task / tiles, tile = task % tiles;
+    // area[p] holds the result of p passes; area[0] is read from the input
+    std::vector<region> area(passes + 1);
+    int top = (tile / tiles_across) * multipass_tile;
+    int left = (tile % tiles_across) * multipass_tile;
+    area[passes] = { top, std::min(top + multipass_tile, frame.rows),
+                     left, std::min(left + multipass_tile, frame.cols) };
+    for (int p = passes - 1; p >= 0; p--) {
+      int radius = kernels[p].cols / 2;
+      area[p] = { std::max(0, area[p+1].top - radius),
+                  std::min(frame.rows, area[p+1].bottom + radius),
+                  std::max(0, area[p+1].left - radius),
+                  std::min(frame.cols, area[p+1].right + radius) };
+    }
+
+    std::vector<unsigned char> current(area[0].rows() * area[0].cols()), next;
+    std::vector<int> partial;
+    for (int row = area[0].top; row < area[0].bottom; row++) {
+      auto in = frame.in[channel] + row * frame.cols;
+      std::copy(in + area[0].left, in + area[0].right,
+                current.begin() + (row - area[0].top) * area[0].cols());
+    }
+
+    for (int p = 0; p < passes; p++) {
+      auto & src = area[p];
+      auto & dst = area[p+1];
+      auto & taps = kernels[p].taps;
+      int kernel_cols = kernels[p].cols;
+      int radius = kernel_cols / 2;
+      // destination columns, relative to dst.left, away from the border
+      int inner_first = std::min(std::max(radius - dst.left, 0), dst.cols());
+      int inner_last = std::max(inner_first,
+                                std::min(frame.cols - radius - dst.left, dst.cols()));
+
+      // horizontal pass over the source rows, for the destination columns
+      partial.resize(src.rows() * dst.cols());
+      for (int row = 0; row < src.rows(); row++) {
+        auto in = current.data() + row * src.cols() + (dst.left - src.left);
+        auto out = partial.data() + row * dst.cols();
+        auto border = [&](int col) {
+          int first = std::max(0, radius - (dst.left + col));
+          int last = std::min(kernel_cols, frame.cols - (dst.left + col) + radius);
+          int value = 0;
+          for (int k = first; k < last; k++)
+            value += in[col+k-radius] * taps[k];
+          out[col] = value;
+        };
+        for (int col = 0; col < inner_first; col++) border(col);
+        row_kernels[p].horizontal(in, out, inner_first, inner_last, taps.data(), kernel_cols);
+        for (int col = inner_last; col < dst.cols(); col++) border(col);
+      }
+
+      // vertical pass into the destination area
+      next.resize(dst.rows() * dst.cols());
+      for (int row = dst.top; row < dst.bottom; row++) {
+        int first = std::max(0, radius - row);
+        int last = std::min(kernel_cols, frame.rows - row + radius);
+        auto out = next.data() + (row - dst.top) * dst.cols();
+        auto border = [&](int col) {
+          int value = 0;
+          for (int k = first; k < last; k++)
+            value += partial[(row + k - radius - src.top) * dst.cols() + col] * taps[k];
+          out[col] = (unsigned char) (value /
+            (row_weight[p][row] * col_weight[p][dst.left + col]));
+        };
+        if ((row < radius) || (row >= frame.rows - radius)) {
+          for (int col = 0; col < dst.cols(); col++) border(col);
+          continue;
+        }
+        for (int col = 0; col < inner_first; col++) border(col);
+        row_kernels[p].vertical(partial.data() + (row - radius - src.top) * dst.cols(),
+                                dst.cols(), out, inner_first, inner_last,
+                                taps.data(), kernel_cols, interior[p]);
+        for (int col = inner_last; col < dst.cols(); col++) border(col);
+      }
+      current.swap(next);
+    }
+
+    auto & out = area[passes];
+    for (int row = out.top; row < out.bottom; row++)
+      std::copy(current.begin() + (row - out.top) * out.cols(),
+                current.begin() + (row - out.top + 1) * out.cols(),
+                frame.out[channel] + row * frame.cols + out.left);
+  }, exec);
+}
+
+// True when all the taps are equal, so the kernel is a box average
+bool is_box_kernel(const blur_kernel& kernel)
+{
+  return std::all_of(kernel.taps.begin(), kernel.taps.end(),
+    [&](int tap) { return tap == kernel.taps[0]; });
+}
+
+// Rows of the vertical pass of the box engine that share one running sum
+constexpr int box_chunk_rows = 64;
+
+// Smallest uniform kernel for which the auto engine prefers running sums
+// over the SIMD engine
+constexpr int box_min_cols = 11;
+
+// Box blur with running sums, whose cost per pixel does not depend on the
+// kernel size. Every row slides a horizontal window, and the vertical pass
+// slides a row of column sums down chunks of rows, each chunk starting its
+// own sums. Both passes are distributed over rows and channels.
+void blur_box(const channel_views& frame, int kernel_cols,
+              const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int radius = kernel_cols / 2;
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  std::vector<int> partial(channels * plane);
+  std::vector<int> ones(kernel_cols, 1);
+  auto col_count = border_weights(frame.cols, ones);
+  auto row_count = border_weights(frame.rows, ones);
+  auto interior = interior_reciprocal(ones);
+  // columns whose window does not cross the border
+  int inner_first = std::min(radius, frame.cols);
+  int inner_last = std::max(inner_first, frame.cols - radius);
+
+  // horizontal pass: window sums of every row
+  map_index(channels * frame.rows, [&](int task) {
+    int channel = task / frame.rows, row = task % frame.rows;
+    auto in = frame.in[channel] + row * frame.cols;
+    auto out = partial.data() + channel * plane + row * frame.cols;
+    int sum = 0;
+    for (int col = 0; col < std::min(radius, frame.cols); col++) sum += in[col];
+    for (int col = 0; col < frame.cols; col++) {
+      if (col + radius < frame.cols) sum += in[col+radius];
+      out[col] = sum;
+      if (col - radius >= 0) sum -= in[col-radius];
+    }
+  }, exec);
+
+  // vertical pass: running column sums down each chunk of rows
+  int chunks = (frame.rows + box_chunk_rows - 1) / box_chunk_rows;
+  map_index(channels * chunks, [&](int task) {
+    int channel = task / chunks;
+    int first_row = (task % chunks) * box_chunk_rows;
+    int last_row = std::min(first_row + box_chunk_rows, frame.rows);
+    auto in = partial.data() + channel * plane;
+    std::vector<int> sum(frame.cols, 0);
+    for (int row = std::max(0, first_row - radius);
+         row < std::min(first_row + radius, frame.rows); row++)
+      for (int col = 0; col < frame.cols; col++)
+        sum[col] += in[row * frame.cols + col];
+
+    for (int row = first_row; row < last_row; row++) {
+      if (row + radius < frame.rows) {
+        auto added = in + (row + radius) * frame.cols;
+        for (int col = 0; col < frame.cols; col++) sum[col] += added[col];
+      }
+      auto out = frame.out[channel] + row * frame.cols;
+      auto border = [&](int col) {
+        out[col] = (unsigned char) (sum[col] / (row_count[row] * col_count[col]));
+      };
+      if (row_count[row] != kernel_cols) {
+        for (int col = 0; col < frame.cols; col++) border(col);
+      }
+      else {
+        for (int col = 0; col < inner_first; col++) border(col);
+        for (int col = inner_first; col < inner_last; col++)
+          out[col] = (unsigned char) ((sum[col] * interior.multiplier) >> interior.shift);
+        for (int col = inner_last; col < frame.cols; col++) border(col);
+      }
+      if (row - radius >= 0) {
+        auto removed = in + (row - radius) * frame.cols;
+        for (int col = 0; col < frame.cols; col++) sum[col] -= removed[col];
+      }
+    }
+  }, exec);
+}
+
+// Normalised coefficients of the Young - van Vliet recursive Gaussian:
+// y[n] = gain * x[n] + a1 * y[n-1] + a2 * y[n-2] + a3 * y[n-3], and the
+// Triggs - Sdika matrix that starts its anti-causal pass
+struct iir_coefficients {
+  float gain, a1, a2, a3;
+  double boundary[3][3];
+};
+
+iir_coefficients make_iir_coefficients(double sigma)
+{
+  double q = (sigma >= 2.5) ? 0.98711 * sigma - 0.96330 :
+                              3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+  double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+  double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+  double b3 = 0.422205 * q * q * q;
+  double a1 = b1 / b0, a2 = b2 / b0, a3 = b3 / b0;
+  double scale = 1 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+  return { (float) (1 - a1 - a2 - a3), (float) a1, (float) a2, (float) a3,
+           { { scale * (1 - a2 - a1 * a3 - a3 * a3),
+               scale * (a3 + a1) * (a2 + a1 * a3),
+               scale * a3 * (a1 + a2 * a3) },
+             { scale * (a1 + a2 * a3),
+               -scale * (a2 - 1) * (a2 + a1 * a3),
+               -scale * a3 * (a1 * a3 + a3 * a3 + a2 - 1) },
+             { scale * (a1 * a3 + a2 + a1 * a1 - a2 * a2),
+               scale * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a2 * a3 + a3),
+               scale * a3 * (a1 + a2 * a3) } } };
+}
+
+// Anti-causal outputs y[n], y[n+1] and y[n+2] at the last sample n of a
+// signal whose last input repeats past it, from the causal outputs w0 =
+// w[n], w1 = w[n-1] and w2 = w[n-2] (Triggs and Sdika)
+void iir_boundary(const iir_coefficients& c, float last,
+                  float w0, float w1, float w2, float * y)
+{
+  double d0 = w0 - last, d1 = w1 - last, d2 = w2 - last;
+  for (int k = 0; k < 3; k++)
+    y[k] = (float) (last + c.gain *
+      (c.boundary[k][0] * d0 + c.boundary[k][1] * d1 + c.boundary[k][2] * d2));
+}
+
+// Rows and columns filtered side by side by the horizontal and vertical
+// passes of the recursive Gaussian
+constexpr int iir_block_rows = 8, iir_block_cols = 1024;
+
+// Recursive Gaussian blur: a causal and an anti-causal pass along every row
+// and then along every column, with a cost per pixel that does not depend
+// on sigma. Blocks of rows and blocks of columns, each filtered side by
+// side, are distributed through the GrPPI execution. Edges replicate the
+// first and last pixel: the causal passes start from the steady state of
+// the first one, and the anti-causal passes from the Triggs - Sdika state
+// of the last one.
+void blur_iir(const channel_views& frame, double sigma,
+              const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  auto c = make_iir_coefficients(sigma);
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  std::vector<float> rows(channels * plane);
+
+  // horizontal passes, interleaving the recursions of a block of rows
+  int row_blocks = (frame.rows + iir_block_rows - 1) / iir_block_rows;
+  map_index(channels * row_blocks, [&](int task) {
+    int channel = task / row_blocks;
+    int first = (task % row_blocks) * iir_block_rows;
+    int count = std::min(iir_block_rows, frame.rows - first);
+    const unsigned char * in[iir_block_rows];
+    float * out[iir_block_rows];
+    float w1[iir_block_rows], w2[iir_block_rows], w3[iir_block_rows];
+    for (int r = 0; r < count; r++) {
+      in[r] = frame.in[channel] + (first + r) * frame.cols;
+      out[r] = rows.data() + channel * plane + (first + r) * frame.cols;
+      w1[r] = w2[r] = w3[r] = in[r][0];
+    }
+    for (int col = 0; col < frame.cols; col++) {
+      for (int r = 0; r < count; r++) {
+        float w = c.gain * in[r][col] + c.a1 * w1[r] + c.a2 * w2[r] + c.a3 * w3[r];
+        out[r][col] = w;
+        w3[r] = w2[r]; w2[r] = w1[r]; w1[r] = w;
+      }
+    }
+    for (int r = 0; r < count; r++) {
+      float y[3];
+      iir_boundary(c, in[r][frame.cols - 1], w1[r], w2[r], w3[r], y);
+      out[r][frame.cols - 1] = w1[r] = y[0];
+      w2[r] = y[1];
+      w3[r] = y[2];
+    }
+    for (int col = frame.cols - 2; col >= 0; col--) {
+      for (int r = 0; r < count; r++) {
+        float y = c.gain * out[r][col] + c.a1 * w1[r] + c.a2 * w2[r] + c.a3 * w3[r];
+        out[r][col] = y;
+        w3[r] = w2[r]; w2[r] = w1[r]; w1[r] = y;
+      }
+    }
+  }, exec);
+
+  // vertical passes over blocks of columns, walking the rows in order
+  int blocks = (frame.cols + iir_block_cols - 1) / iir_block_cols;
+  map_index(channels * blocks, [&](int task) {
+    int channel = task / blocks;
+    int first = (task % blocks) * iir_block_cols;
+    int cols = std::min(iir_block_cols, frame.cols - first);
+    auto data = rows.data() + channel * plane + first;
+    auto out = frame.out[channel] + first;
+    auto line = [&](int row) { return data + row * frame.cols; };
+    // the state of each pass lives in the rows already filtered, apart from
+    // the edge row replicated before the first one and the two rows past
+    // the last one
+    float edge[iir_block_cols], last[iir_block_cols], after[2][iir_block_cols];
+    std::copy(line(0), line(0) + cols, edge);
+    std::copy(line(frame.rows-1), line(frame.rows-1) + cols, last);
+    for (int row = 0; row < frame.rows; row++) {
+      const float * w1 = (row >= 1) ? line(row-1) : edge;
+      const float * w2 = (row >= 2) ? line(row-2) : edge;
+      const float * w3 = (row >= 3) ? line(row-3) : edge;
+      auto w = line(row);
+      for (int col = 0; col < cols; col++)
+        w[col] = c.gain * w[col] + c.a1 * w1[col] + c.a2 * w2[col] + c.a3 * w3[col];
+    }
+    auto causal = [&](int row) { return (row >= 0) ? line(row) : edge; };
+    auto anti_causal = [&](int row) {
+      return (row < frame.rows) ? line(row) : after[row - frame.rows];
+    };
+    const float * w1 = causal(frame.rows-2), * w2 = causal(frame.rows-3);
+    auto y0 = line(frame.rows-1);
+    for (int col = 0; col < cols; col++) {
+      float y[3];
+      iir_boundary(c, last[col], y0[col], w1[col], w2[col], y);
+      y0[col] = y[0];
+      after[0][col] = y[1];
+      after[1][col] = y[2];
+    }
+    auto edge_pixels = out + (frame.rows-1) * frame.cols;
+    for (int col = 0; col < cols; col++)
+      edge_pixels[col] = (unsigned char) std::min(255.0f, std::max(0.0f, y0[col] + 0.5f));
+    for (int row = frame.rows - 2; row >= 0; row--) {
+      const float * y1 = anti_causal(row+1);
+      const float * y2 = anti_causal(row+2);
+      const float * y3 = anti_causal(row+3);
+      auto y = line(row);
+      auto pixels = out + row * frame.cols;
+      for (int col = 0; col < cols; col++) {
+        y[col] = c.gain * y[col] + c.a1 * y1[col] + c.a2 * y2[col] + c.a3 * y3[col];
+        pixels[col] = (unsigned char) std::min(255.0f, std::max(0.0f, y[col] + 0.5f));
+      }
+    }
+  }, exec);
+}
+
+// Largest radius of the rank filter, so that the window counts fit in
+// 16-bit histogram bins
+constexpr int rank_max_radius = 127;
+
+// Rows and columns of the tiles of the rank filter. The column histograms
+// of a tile, with its halo, stay resident in the L2 cache.
+constexpr int rank_tile_rows = 64, rank_tile_cols = 256;
+
+template <int Bins>
+void add_bins(std::uint16_t * histogram, const std::uint16_t * column)
+{
+  for (int bin = 0; bin < Bins; bin++) histogram[bin] += column[bin];
+}
+
+template <int Bins>
+void remove_bins(std::uint16_t * histogram, const std::uint16_t * column)
+{
+  for (int bin = 0; bin < Bins; bin++) histogram[bin] -= column[bin];
+}
+
+// Percentile filter over the square window of the given radius, clipped
+// to the image, with the sliding histograms of Perreault and Hebert. Every
+// tile keeps one histogram per column, moved down a row at a time, and the
+// window histogram slides along each row adding and removing whole column
+// histograms. Its 16 coarse bins are always kept up to date, while the 256
+// fine bins are only brought up to date for the coarse bin holding the
+// wanted rank, so the cost per pixel does not depend on the radius. Tiles
+// of all the channels run through the GrPPI execution.
+void blur_rank(const channel_views& frame, int radius, double percentile,
+               const grppi::dynamic_execution& exec)
+{
+  int channels = frame.in.size();
+  int tile_rows = std::max(rank_tile_rows, 2 * radius + 1);
+  int tile_cols = std::max(rank_tile_cols, 2 * radius + 1);
+  int tiles_down = (frame.rows + tile_rows - 1) / tile_rows;
+  int tiles_across = (frame.cols + tile_cols - 1) / tile_cols;
+  int tiles = tiles_down * tiles_across;
+  map_index(channels * tiles, [&](int task) {
+    int channel = task / tiles, tile = task % tiles;
+    int first_row = (tile / tiles_across) * tile_rows;
+    int last_row = std::min(first_row + tile_rows, frame.rows);
+    int first_col = (tile % tiles_across) * tile_cols;
+    int last_col = std::min(first_col + tile_cols, frame.cols);
+    // columns whose histograms the windows of the tile reach
+    int hist_first = std::max(first_col - radius, 0);
+    int hist_last = std::min(last_col + radius, frame.cols);
+    auto in = frame.in[channel];
+    std::vector<std::uint16_t> column_fine((hist_last - hist_first) * 256);
+    std::vector<std::uint16_t> column_coarse((hist_last - hist_first) * 16);
+    auto fine_of = [&](int col) { return column_fine.data() + (col - hist_first) * 256; };
+    auto coarse_of = [&](int col) { return column_coarse.data() + (col - hist_first) * 16; };
+    auto update = [&](int row, int delta) {
+      if ((row < 0) || (row >= frame.rows)) return;
+      auto pixels = in + row * frame.cols;
+      for (int col = hist_first; col < hist_last; col++) {
+        fine_of(col)[pixels[col]] += delta;
+        coarse_of(col)[pixels[col] >> 4] += delta;
+      }
+    };
+    for (int row = first_row - radius; row < first_row + radius; row++) update(row, 1);
+
+    for (int row = first_row; row < last_row; row++) {
+      if (row > first_row) update(row - radius - 1, -1);
+      update(row + radius, 1);
+      int window_rows = std::min(row + radius, frame.rows - 1) - std::max(row - radius, 0) + 1;
+      auto out = frame.out[channel] + row * frame.cols;
+
+      std::uint16_t coarse[16] = {}, fine[256];
+      // column the fine bins of every coarse bin were last brought up to
+      // date for; far enough to the left, they have to be rebuilt
+      int fine_col[16];
+      std::fill(fine_col, fine_col + 16, first_col - 2 * radius - 2);
+      for (int col = hist_first; col < std::min(first_col + radius + 1, hist_last); col++)
+        add_bins<16>(coarse, coarse_of(col));
+
+      for (int col = first_col; col < last_col; col++) {
+        if (col > first_col) {
+          if (col + radius < frame.cols) add_bins<16>(coarse, coarse_of(col + radius));
+          if (col - radius - 1 >= 0) remove_bins<16>(coarse, coarse_of(col - radius - 1));
+        }
+        int window_cols = std::min(col + radius, frame.cols - 1) - std::max(col - radius, 0) + 1;
+        int rank = (int) (percentile / 100 * (window_rows * window_cols - 1));
+
+        int bin = 0, below = 0;
+        while (below + coarse[bin] <= rank) below += coarse[bin++];
+
+        auto segment = fine + bin * 16;
+        if (col - fine_col[bin] > 2 * radius + 1) {
+          std::fill(segment, segment + 16, 0);
+          for (int c = std::max(col - radius, 0); c <= std::min(col + radius, frame.cols - 1); c++)
+            add_bins<16>(segment, fine_of(c) + bin * 16);
+        }
+        else {
+          for (int c = fine_col[bin] + 1; c <= col; c++) {
+            if (c + radius < frame.cols) add_bins<16>(segment, fine_of(c + radius) + bin * 16);
+            if (c - radius - 1 >= 0) remove_bins<16>(segment, fine_of(c - radius - 1) + bin * 16);
+          }
+        }
+        fine_col[bin] = col;
+
+        int value = bin * 16;
+        while (below + fine[value] <= rank) below += fine[value++];
+        out[col] = (unsigned char) value;
+      }
+    }
+  }, exec);
+}
+
+// Blur engines selectable from the command line
+const std::vector<std::string> blur_engines{
+  "direct", "separable", "tiled", "simd", "unrolled", "multipass", "box", "auto",
+  "bench" };
+
+// Blurs all the channels of the frame with one kernel. The direct engine
+// is the per-channel reference implementation, and the auto engine runs
+// the box engine for large uniform kernels and the unrolled one otherwise.
+// Recursive Gaussian kernels always run the recursive engine, and rank
+// kernels the histogram one.
+void blur_pass(const std::string& engine, const channel_views& frame,
+               const blur_kernel& kernel, const grppi::dynamic_execution& exec)
+{
+  if (kernel.sigma > 0) blur_iir(frame, kernel.sigma, exec);
+  else if (kernel.rank_radius > 0)
+    blur_rank(frame, kernel.rank_radius, kernel.percentile, exec);
+  else if (engine == "auto") {
+    bool box = is_box_kernel(kernel) && (kernel.cols >= box_min_cols);
+    blur_pass(box ? "box" : "unrolled", frame, kernel, exec);
+  }
+  else if (engine == "box") blur_box(frame, kernel.cols, exec);
+  else if (engine == "separable") blur_separable(frame, kernel.taps, exec);
+  else if (engine == "tiled") blur_tiled(frame, kernel.kernel, kernel.cols, exec);
+  else if (engine == "simd")
+    blur_simd(frame, kernel.taps, select_row_kernels(), exec);
+  else if (engine == "unrolled")
+    blur_simd(frame, kernel.taps, select_row_kernels(kernel.taps), exec);
+  else if (engine == "multipass") blur_multipass(frame, { kernel }, exec);
+  else {
+    std::size_t plane = (std::size_t) frame.rows * frame.cols;
+    for (int channel = 0; channel < frame.in.size(); channel++) {
+      std::vector<unsigned char> in(frame.in[channel], frame.in[channel] + plane);
+      auto result = blur(std::move(in), frame.cols, kernel.kernel, kernel.cols, exec);
+      std::copy(result.begin(), result.end(), frame.out[channel]);
+    }
+  }
+}
+
+// Blurs all the channels of the frame with the sequence of kernels. The
+// multi-pass engine fuses the passes of convolution kernels; otherwise
+// every kernel runs one full pass over the frame.
+void blur_channels(const std::string& engine, const channel_views& frame,
+                   const std::vector<blur_kernel>& kernels,
+                   const grppi::dynamic_execution& exec)
+{
+  bool fused = (engine == "multipass") &&
+    std::all_of(kernels.begin(), kernels.end(), is_convolution);
+  if (fused || (kernels.size() == 1)) {
+    if (fused) blur_multipass(frame, kernels, exec);
+    else blur_pass(engine, frame, kernels[0], exec);
+    return;
+  }
+
+  // one set of intermediate planes for two kernels, two alternating sets
+  // for longer chains
+  int channels = frame.in.size();
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  std::vector<std::vector<unsigned char>> buffers(
+    std::min<int>(kernels.size() - 1, 2) * channels);
+  for (auto & buffer : buffers) buffer.resize(plane);
+  channel_views pass{ frame.in, {}, frame.rows, frame.cols };
+  for (int k = 0; k < kernels.size(); k++) {
+    pass.out.clear();
+    for (int channel = 0; channel < channels; channel++)
+      pass.out.push_back((k == kernels.size() - 1) ? frame.out[channel] :
+                         buffers[(k % 2) * channels + channel].data());
+    blur_pass(engine, pass, kernels[k], exec);
+    pass.in.assign(pass.out.begin(), pass.out.end());
+  }
+}
+
+// Side of the tiles in which the incremental blur tracks changes
+constexpr int dirty_tile = 64;
+
+// Rows above and below, and columns left and right, of an output area
+// that its blurred value depends on through all the kernels. The direct
+// engine wraps around rows, so it needs one more row per kernel.
+int blur_halo(const std::string& engine, const std::vector<blur_kernel>& kernels)
+{
+  int halo = 0;
+  for (auto & k : kernels) halo += k.cols / 2 + ((engine == "direct") ? 1 : 0);
+  return halo;
+}
+
+// Tiles where two frames differ, compared in parallel and merged into runs
+// along every row of tiles
+std::vector<region> changed_regions(const std::vector<const unsigned char*>& previous,
+                                    const std::vector<const unsigned char*>& current,
+                                    int rows, int cols, const grppi::dynamic_execution& exec)
+{
+  int tiles_down = (rows + dirty_tile - 1) / dirty_tile;
+  int tiles_across = (cols + dirty_tile - 1) / dirty_tile;
+  std::vector<char> changed(tiles_down * tiles_across);
+  map_index(tiles_down * tiles_across, [&](int tile) {
+    int top = (tile / tiles_across) * dirty_tile;
+    int left = (tile % tiles_across) * dirty_tile;
+    int bottom = std::min(top + dirty_tile, rows);
+    int right = std::min(left + dirty_tile, cols);
+    for (int channel = 0; channel < current.size(); channel++)
+      for (int row = top; row < bottom; row++) {
+        auto offset = row * cols;
+        if (!std::equal(current[channel] + offset + left, current[channel] + offset + right,
+                        previous[channel] + offset + left)) {
+          changed[tile] = 1;
+          return;
+        }
+      }
+  }, exec);
+
+  std::vector<region> regions;
+  for (int down = 0; down < tiles_down; down++)
+    for (int across = 0; across < tiles_across; across++) {
+      if (!changed[down * tiles_across + across]) continue;
+      int first = across;
+      while ((across + 1 < tiles_across) && changed[down * tiles_across + across + 1]) across++;
+      regions.push_back({ down * dirty_tile, std::min((down + 1) * dirty_tile, rows),
+                          first * dirty_tile, std::min((across + 1) * dirty_tile, cols) });
+    }
+  return regions;
+}
+
+// Incremental blur of a frame that differs from the previous one only in
+// the changed regions. The output tiles those regions reach through the
+// kernels are blurred again, each from its area grown by the halo, and the
+// others are copied from the previous output, which may be frame.out
+// itself. The direct engine wraps around rows, so its tiles span whole
+// rows. Recursive Gaussians have an unbounded support, so frames with
+// them are always blurred in full. Returns the number of pixels blurred.
+std::size_t blur_incremental(const std::string& engine, const channel_views& frame,
+                             const std::vector<const unsigned char*>& previous_out,
+                             const std::vector<region>& changed,
+                             const std::vector<blur_kernel>& kernels,
+                             const grppi::dynamic_execution& exec)
+{
+  std::size_t plane = (std::size_t) frame.rows * frame.cols;
+  if (std::any_of(kernels.begin(), kernels.end(),
+                  [](const blur_kernel& k) { return k.sigma > 0; })) {
+    blur_channels(engine, frame, kernels, exec);
+    return plane;
+  }
+
+  int channels = frame.in.size();
+  int halo = blur_halo(engine, kernels);
+  int tile_rows = dirty_tile;
+  int tile_cols = (engine == "direct") ? frame.cols : dirty_tile;
+  int tiles_down = (frame.rows + tile_rows - 1) / tile_rows;
+  int tiles_across = (frame.cols + tile_cols - 1) / tile_cols;
+  std::vector<char> dirty(tiles_down * tiles_across);
+  for (auto & r : changed) {
+    int top = std::max(0, r.top - halo) / tile_rows;
+    int bottom = (std::min(frame.rows, r.bottom + halo) - 1) / tile_rows;
+    int left = std::max(0, r.left - halo) / tile_cols;
+    int right = (std::min(frame.cols, r.right + halo) - 1) / tile_cols;
+    for (int down = top; down <= bottom; down++)
+      for (int across = left; across <= right; across++)
+        dirty[down * tiles_across + across] = 1;
+  }
+
+  grppi::dynamic_execution tile_exec = grppi::sequential_execution{};
+  map_index(tiles_down * tiles_across, [&](int tile) {
+    int top = (tile / tiles_across) * tile_rows;
+    int left = (tile % tiles_across) * tile_cols;
+    region out{ top, std::min(top + tile_rows, frame.rows),
+                left, std::min(left + tile_cols, frame.cols) };
+    if (!dirty[tile]) {
+      for (int channel = 0; channel < channels; channel++) {
+        if (previous_out[channel] == frame.out[channel]) continue;
+        for (int row = out.top; row < out.bottom; row++)
+          std::copy(previous_out[channel] + row * frame.cols + out.left,
+                    previous_out[channel] + row * frame.cols + out.right,
+                    frame.out[channel] + row * frame.cols + out.left);
+      }
+      return;
+    }
+
+    region area{ std::max(0, out.top - halo), std::min(frame.rows, out.bottom + halo),
+                 std::max(0, out.left - halo), std::min(frame.cols, out.right + halo) };
+    std::size_t area_plane = (std::size_t) area.rows() * area.cols();
+    std::vector<unsigned char> in(channels * area_plane), blurred(channels * area_plane);
+    channel_views part{ {}, {}, area.rows(), area.cols() };
+    for (int channel = 0; channel < channels; channel++) {
+      auto area_in = in.data() + channel * area_plane;
+      for (int row = area.top; row < area.bottom; row++)
+        std::copy(frame.in[channel] + row * frame.cols + area.left,
+                  frame.in[channel] + row * frame.cols + area.right,
+                  area_in + (row - area.top) * area.cols());
+      part.in.push_back(area_in);
+      part.out.push_back(blurred.data() + channel * area_plane);
+    }
+    blur_channels(engine, part, kernels, tile_exec);
+    for (int channel = 0; channel < channels; channel++)
+      for (int row = out.top; row < out.bottom; row++) {
+        auto line = part.out[channel] + (row - area.top) * area.cols() + (out.left - area.left);
+        std::copy(line, line + out.cols(), frame.out[channel] + row * frame.cols + out.left);
+      }
+  }, exec);
+
+  std::size_t blurred = 0;
+  for (int tile = 0; tile < dirty.size(); tile++) {
+    if (!dirty[tile]) continue;
+    int top = (tile / tiles_across) * tile_rows;
+    int left = (tile % tiles_across) * tile_cols;
+    blurred += (std::size_t) (std::min(top + tile_rows, frame.rows) - top) *
+               (std::min(left + tile_cols, frame.cols) - left);
+  }
+  return blurred;
+}
+
 grppi::dynamic_execution execution_mode(const std::string & opt, int nr_threads) 
 {
   using namespace grppi;
@@ -70,9 +1256,8 @@ grppi::dynamic_execution execution_mode(const std::string & opt, int nr_threads)
   return {};
 }
 
-void load_kernel(std::string kernel_file, std::vector<int>& kernel, int& kernel_cols)
+void load_kernel_taps(std::string kernel_file, std::vector<int>& ker)
 {
-  std::vector<int> ker;
   std::ifstream ifile( kernel_file );
   if( !ifile.is_open() ) {
     std::cerr << "Error: can't open file " << kernel_file << std::endl;
@@ -85,106 +1270,587 @@ void load_kernel(std::string kernel_file, std::vector<int>& kernel, int& kernel_
     std::cerr << "Error: kernel should have odd size" << std::endl;
     std::exit(-1);
   }
-  kernel_cols= ker.size();
-  for (auto i : ker)
-    for (auto j : ker) 
+}
+
+// Loads the taps of a kernel file once and builds the 2D kernel from them
+void load_kernel(std::string kernel_file, std::vector<int>& taps,
+                 std::vector<int>& kernel, int& kernel_cols)
+{
+  load_kernel_taps(kernel_file, taps);
+  kernel_cols= taps.size();
+  for (auto i : taps)
+    for (auto j : taps) 
       kernel.push_back(i*j);
 }
 
+// Radius of a rank kernel, checked against the histogram limits
+int rank_radius(const std::string& radius)
+{
+  int value = std::stoi(radius);
+  if ((value < 1) || (value > rank_max_radius)) {
+    std::cerr << "Error: rank filter radius should be between 1 and "
+              << rank_max_radius << std::endl;
+    std::exit(-1);
+  }
+  return value;
+}
+
+// Loads a comma-separated sequence of kernels, applied in order. Every
+// entry is a kernel file, gauss:<sigma> for a recursive Gaussian,
+// median:<radius> for a median filter or percentile:<p>:<radius> for the
+// p-th percentile of the window.
+std::vector<blur_kernel> load_kernels(const std::string& kernel_files)
+{
+  std::vector<blur_kernel> kernels;
+  std::istringstream files{kernel_files};
+  for (std::string file; std::getline(files, file, ','); ) {
+    blur_kernel k;
+    k.name = file;
+    if ((file.compare(0, 7, "median:") == 0) || (file.compare(0, 11, "percentile:") == 0)) {
+      auto spec = file.substr(file.find(':') + 1);
+      if (file[0] == 'p') {
+        auto colon = spec.find(':');
+        if (colon == std::string::npos) {
+          std::cerr << "Error: percentile filter should be percentile:<p>:<radius>" << std::endl;
+          std::exit(-1);
+        }
+        k.percentile = std::stod(spec.substr(0, colon));
+        spec = spec.substr(colon + 1);
+        if ((k.percentile < 0) || (k.percentile > 100)) {
+          std::cerr << "Error: percentile should be between 0 and 100" << std::endl;
+          std::exit(-1);
+        }
+      }
+      k.rank_radius = rank_radius(spec);
+      k.cols = 2 * k.rank_radius + 1;
+      kernels.push_back(k);
+      continue;
+    }
+    if (file.compare(0, 6, "gauss:") == 0) {
+      k.sigma = std::stod(file.substr(6));
+      if (k.sigma < 0.5) {
+        std::cerr << "Error: gaussian sigma should be at least 0.5" << std::endl;
+        std::exit(-1);
+      }
+      k.cols = 2 * (int) std::ceil(3 * k.sigma) + 1;
+      kernels.push_back(k);
+      continue;
+    }
+    load_kernel(file, k.taps, k.kernel, k.cols);
+    kernels.push_back(k);
+  }
+  if (kernels.empty()) {
+    std::cerr << "Error: no kernel given" << std::endl;
+    std::exit(-1);
+  }
+  return kernels;
+}
+
+// Layout of a 24-bit uncompressed BMP, as validated from its headers
+struct bmp_layout {
+  int width, height;
+  std::size_t pixel_offset;
+  std::size_t row_stride; // bytes per row, padded to a multiple of 4
+};
+
+constexpr std::size_t bmp_headers_size = 54;
+
+template <typename T>
+T read_bmp_field(const unsigned char * data, std::size_t offset)
+{
+  T value;
+  std::memcpy(&value, data + offset, sizeof(value));
+  return value;
+}
+
+// Validates the BMP headers in place and returns the pixel layout. The data
+// must hold at least the headers, while size is the size of the whole file.
+bmp_layout parse_bmp_header(const unsigned char * data, std::size_t size)
+{
+  if ((size < bmp_headers_size) || (data[0] != 'B') || (data[1] != 'M')) {
+    std::cerr << "Error: BMP incorrect format" << std::endl;
+    std::exit(-1);
+  }
+  // parse header file -> "BM <4:size> 0 0 0 0 <4:offset_pixels>"
+  auto pixel_offset = read_bmp_field<std::uint32_t>(data, 10);
+  // get data from image header
+  auto width = read_bmp_field<std::int32_t>(data, 18);
+  auto height = read_bmp_field<std::int32_t>(data, 22);
+  auto planes = read_bmp_field<std::int16_t>(data, 26);
+  auto bit_count = read_bmp_field<std::int16_t>(data, 28);
+  auto compresion = read_bmp_field<std::int32_t>(data, 30);
+
+  if ((planes != 1) || (bit_count != 24) || (compresion != 0) ||
+      (width <= 0) || (height <= 0) || (pixel_offset < bmp_headers_size)) {
+    std::cerr << "Error: BMP incorrect format" << std::endl;
+    std::exit(-1);
+  }
+  bmp_layout layout{ width, height, pixel_offset, ((std::size_t) width * 3 + 3) / 4 * 4 };
+  if (size < layout.pixel_offset + layout.row_stride * height) {
+    std::cerr << "Error: BMP file is truncated" << std::endl;
+    std::exit(-1);
+  }
+  return layout;
+}
+
+// Splits one row of BGR pixels into the planar channels
+void deinterleave_row(const unsigned char * bgr, int width,
+  unsigned char * red, unsigned char * green, unsigned char * blue)
+{
+  for (int col = 0; col < width; col++, bgr += 3) {
+    blue[col] = bgr[0];
+    green[col] = bgr[1];
+    red[col] = bgr[2];
+  }
+}
+
+// Loads a BMP by memory-mapping the file. The headers are validated in
+// place and the rows are deinterleaved in parallel into the channels.
 void load_bmp(std::string input_file,
   int &width, int &height,
   std::vector<unsigned char> &header_info,
   std::vector<unsigned char> &red,
   std::vector<unsigned char> &green,
-  std::vector<unsigned char> &blue)
+  std::vector<unsigned char> &blue,
+  const grppi::dynamic_execution& exec)
 {
-  // open BMP input file
-  std::ifstream input( input_file, std::ios::binary );
-  if( !input.is_open() )  {
-    std::cerr << "Can't open file" << std::endl;
-    return;
+  // map BMP input file
+  int fd = open(input_file.c_str(), O_RDONLY);
+  struct stat info;
+  if ((fd < 0) || (fstat(fd, &info) != 0)) {
+    std::cerr << "Error: can't open file " << input_file << std::endl;
+    std::exit(-1);
+  }
+  std::size_t size = info.st_size;
+  if (size < bmp_headers_size) {
+    std::cerr << "Error: BMP incorrect format" << std::endl;
+    std::exit(-1);
+  }
+  void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Error: can't map file " << input_file << std::endl;
+    std::exit(-1);
   }
+  madvise(mapping, size, MADV_WILLNEED);
+  auto data = static_cast<const unsigned char *>(mapping);
 
-  // save BMP input file to a buffer
-  std::vector<unsigned char> buffer( ( std::istreambuf_iterator<char>( input ) ),
-   ( std::istreambuf_iterator<char>() ) );
-  input.close();
+  auto layout = parse_bmp_header(data, size);
+  header_info.assign(data, data + layout.pixel_offset);
+  width = layout.width;
+  height = layout.height;
 
-  // load header file from buffer
-  auto it = std::next( buffer.begin(), 14 );
-  std::move( buffer.begin(), it, std::back_inserter( header_info ) );
-  buffer.erase( buffer.begin(), it );
+  // get image from the mapping
+  std::size_t pixels = (std::size_t) width * height;
+  red.resize(pixels);
+  green.resize(pixels);
+  blue.resize(pixels);
+  map_index(height, [&](int row) {
+    std::size_t first = (std::size_t) row * width;
+    deinterleave_row(data + layout.pixel_offset + row * layout.row_stride, width,
+                     red.data() + first, green.data() + first, blue.data() + first);
+  }, exec);
 
-  // parse header file -> "BM <4:size> 0 0 0 0 <4:offset_pixels>"
-  auto file_size = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 2 );
-  auto pixel_offset = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 10 );
-
-  // load image header from buffer
-  it = std::next( buffer.begin(), pixel_offset-14 );
-  std::move( buffer.begin(), it, std::back_inserter( header_info ) );
-  buffer.erase( buffer.begin(), it );
-
-  // get data from header
-  auto img_header_size = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 4 );
-  width = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 18 );
-  height = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 22 );
-  auto planes = *reinterpret_cast<short int*>( (unsigned char*)header_info.data() + 26 );
-  auto bit_count = *reinterpret_cast<short int*>( (unsigned char*)header_info.data() + 28 );
-  auto compresion = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 30 );
-  auto image_size = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 34 );
-  auto x_pxl_meter = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 38 );
-  auto y_pxl_meter = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 42 );
-  auto crl_used = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 46 );
-  auto crl_important = *reinterpret_cast<int*>( (unsigned char*)header_info.data() + 50 );
-
-  if ((planes != 1) || (bit_count != 24) || (compresion != 0)) {
+  munmap(mapping, size);
+}
+
+// Joins one row of planar channels into BGR pixels
+void interleave_row(const unsigned char * red, const unsigned char * green,
+  const unsigned char * blue, int width, unsigned char * bgr)
+{
+  for (int col = 0; col < width; col++, bgr += 3) {
+    bgr[0] = blue[col];
+    bgr[1] = green[col];
+    bgr[2] = red[col];
+  }
+}
+
+// Encodes the headers and the padded BGR rows into one contiguous buffer,
+// with the rows encoded in parallel
+std::vector<unsigned char> encode_bmp(int width, int height,
+  const std::vector<unsigned char> &header_info,
+  const std::vector<unsigned char> &red,
+  const std::vector<unsigned char> &green,
+  const std::vector<unsigned char> &blue,
+  const grppi::dynamic_execution& exec)
+{
+  std::size_t row_stride = ((std::size_t) width * 3 + 3) / 4 * 4;
+  std::vector<unsigned char> buffer(header_info.size() + row_stride * height);
+  std::copy(header_info.begin(), header_info.end(), buffer.begin());
+  map_index(height, [&](int row) {
+    std::size_t first = (std::size_t) row * width;
+    auto out = buffer.data() + header_info.size() + row * row_stride;
+    interleave_row(red.data() + first, green.data() + first, blue.data() + first,
+                   width, out);
+    std::fill(out + width * 3, out + row_stride, 0);
+  }, exec);
+  return buffer;
+}
+
+// Writes the whole buffer to a file with as few write calls as possible
+void write_file(const std::string& output_file,
+  const unsigned char * data, std::size_t size)
+{
+  int fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Error: can't create file " << output_file << std::endl;
+    std::exit(-1);
+  }
+  while (size > 0) {
+    auto written = write(fd, data, size);
+    if (written < 0) {
+      std::cerr << "Error: can't write file " << output_file << std::endl;
+      std::exit(-1);
+    }
+    data += written;
+    size -= written;
+  }
+  close(fd);
+}
+
+void save_bmp(std::string output_file,
+              int width, int height,
+              const std::vector<unsigned char> &header_info,
+              const std::vector<unsigned char> &red,
+              const std::vector<unsigned char> &green,
+              const std::vector<unsigned char> &blue,
+              const grppi::dynamic_execution& exec)
+{
+  auto buffer = encode_bmp(width, height, header_info, red, green, blue, exec);
+  write_file(output_file, buffer.data(), buffer.size());
+}
+
+// Reads size bytes at the given file offset, retrying short reads
+void read_at(int fd, const std::string& file, unsigned char * data,
+             std::size_t size, std::size_t offset)
+{
+  while (size > 0) {
+    auto done = pread(fd, data, size, offset);
+    if (done <= 0) {
+      std::cerr << "Error: can't read file " << file << std::endl;
+      std::exit(-1);
+    }
+    data += done;
+    size -= done;
+    offset += done;
+  }
+}
+
+// Writes size bytes at the given file offset, retrying short writes
+void write_at(int fd, const std::string& file, const unsigned char * data,
+              std::size_t size, std::size_t offset)
+{
+  while (size > 0) {
+    auto done = pwrite(fd, data, size, offset);
+    if (done < 0) {
+      std::cerr << "Error: can't write file " << file << std::endl;
+      std::exit(-1);
+    }
+    data += done;
+    size -= done;
+    offset += done;
+  }
+}
+
+// Bytes needed per pixel of a strip by blur_channels: the interleaved file
+// rows and the planar input and output channels, the intermediate planes
+// between the passes of a chain, and the scratch of the most demanding
+// pass, which for most engines is a 32-bit partial sum per channel. The
+// scratch is counted twice for chains: the heap may still hold the one
+// freed by the last pass of a strip when the first pass of the next,
+// slightly taller, strip gets its own.
+std::size_t strip_bytes_per_pixel(const std::string& engine,
+                                  const std::vector<blur_kernel>& kernels)
+{
+  constexpr std::size_t channels = 3;
+  bool fused = (engine == "multipass") &&
+    std::all_of(kernels.begin(), kernels.end(), is_convolution);
+  std::size_t bytes = 3 * channels;
+  if (!fused) bytes += std::min<std::size_t>(kernels.size() - 1, 2) * channels;
+
+  std::size_t scratch = 0;
+  for (auto & k : kernels) {
+    std::size_t pass = 4 * channels;
+    if (k.rank_radius > 0) pass = 0;
+    else if ((k.sigma == 0) && ((engine == "direct") || (engine == "tiled"))) pass = 2;
+    scratch = std::max(scratch, pass);
+  }
+  if (!fused && (kernels.size() > 1)) scratch *= 2;
+  return bytes + scratch;
+}
+
+// Blurs a BMP file that does not fit in memory by streaming horizontal
+// strips through buffers of at most budget bytes. Every strip is read
+// with the halo rows of the kernels above and below and blurred in
+// parallel as a whole, and only its own rows are written, in order, to
+// the output.
+void blur_strips(const std::string& input_file, const std::string& output_file,
+                 const std::string& engine, const std::vector<blur_kernel>& kernels,
+                 std::size_t budget, const grppi::dynamic_execution& exec)
+{
+  int input = open(input_file.c_str(), O_RDONLY);
+  struct stat info;
+  if ((input < 0) || (fstat(input, &info) != 0)) {
+    std::cerr << "Error: can't open file " << input_file << std::endl;
+    std::exit(-1);
+  }
+  unsigned char headers[bmp_headers_size];
+  if (info.st_size < bmp_headers_size) {
     std::cerr << "Error: BMP incorrect format" << std::endl;
     std::exit(-1);
   }
+  read_at(input, input_file, headers, bmp_headers_size, 0);
+  auto layout = parse_bmp_header(headers, info.st_size);
+  int width = layout.width, height = layout.height;
+  std::vector<unsigned char> header_info(layout.pixel_offset);
+  read_at(input, input_file, header_info.data(), header_info.size(), 0);
+
+  int halo = blur_halo(engine, kernels);
+  std::size_t budget_rows = budget / (strip_bytes_per_pixel(engine, kernels) * width);
+  if (budget_rows < 2 * halo + 1) {
+    std::cerr << "Error: memory budget too small for one strip" << std::endl;
+    std::exit(-1);
+  }
+  int strip_rows = std::min<std::size_t>(height, budget_rows - 2 * halo);
+  int buffer_rows = strip_rows + 2 * halo;
+
+  int output = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output < 0) {
+    std::cerr << "Error: can't create file " << output_file << std::endl;
+    std::exit(-1);
+  }
+  write_at(output, output_file, header_info.data(), header_info.size(), 0);
+
+  std::size_t plane = (std::size_t) buffer_rows * width;
+  std::vector<unsigned char> file_rows(buffer_rows * layout.row_stride);
+  std::vector<unsigned char> red(plane), green(plane), blue(plane),
+    result_red(plane), result_green(plane), result_blue(plane);
+
+  for (int first = 0; first < height; first += strip_rows) {
+    int last = std::min(first + strip_rows, height);
+    int top = std::max(0, first - halo);
+    int bottom = std::min(height, last + halo);
+
+    // strip rows plus the halo, deinterleaved into the channels
+    read_at(input, input_file, file_rows.data(), (bottom - top) * layout.row_stride,
+            layout.pixel_offset + top * layout.row_stride);
+    map_index(bottom - top, [&](int row) {
+      std::size_t index = (std::size_t) row * width;
+      deinterleave_row(file_rows.data() + row * layout.row_stride, width,
+                       red.data() + index, green.data() + index, blue.data() + index);
+    }, exec);
+
+    channel_views strip{ { red.data(), green.data(), blue.data() },
+                         { result_red.data(), result_green.data(), result_blue.data() },
+                         bottom - top, width };
+    blur_channels(engine, strip, kernels, exec);
 
-  // get image from buffer
-  int index = 0;
-  for(auto row=0; row < height; row++){
-    for(auto colum=0; colum < width; colum++){
-      blue.push_back(buffer[index]);
-      green.push_back(buffer[index+1]);
-      red.push_back(buffer[index+2]);
-      index += 3;
+    // only the rows of the strip itself are encoded and written
+    map_index(last - first, [&](int row) {
+      std::size_t index = (std::size_t) (first - top + row) * width;
+      auto out = file_rows.data() + row * layout.row_stride;
+      interleave_row(result_red.data() + index, result_green.data() + index,
+                     result_blue.data() + index, width, out);
+      std::fill(out + width * 3, out + layout.row_stride, 0);
+    }, exec);
+    write_at(output, output_file, file_rows.data(), (last - first) * layout.row_stride,
+             layout.pixel_offset + first * layout.row_stride);
+  }
+
+  close(output);
+  close(input);
+}
+
+// Bounds the number of images in flight in the batch pipeline
+class in_flight_limit {
+public:
+  explicit in_flight_limit(int size) : free_{size} {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    released_.wait(lock, [this] { return free_ > 0; });
+    free_--;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      free_++;
     }
-    if ( 0 != (width*3) % 4 ) {
-      index += 4 - ((width*3) % 4);
+    released_.notify_one();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable released_;
+  int free_;
+};
+
+// One image travelling through the batch pipeline. The channels hold the
+// input pixels until the blur stage replaces them with the result.
+struct blur_job {
+  int index;
+  std::string output_file;
+  int width, height;
+  std::vector<unsigned char> header_info, red, green, blue;
+};
+
+bool is_directory(const std::string& path)
+{
+  struct stat info;
+  return (stat(path.c_str(), &info) == 0) && S_ISDIR(info.st_mode);
+}
+
+// Input files of a batch: the BMP files in a directory, or the paths listed
+// one per line in a file given as @list
+std::vector<std::string> batch_inputs(const std::string& input)
+{
+  std::vector<std::string> files;
+  if (input[0] == '@') {
+    std::ifstream list( input.substr(1) );
+    if( !list.is_open() ) {
+      std::cerr << "Error: can't open file " << input.substr(1) << std::endl;
+      std::exit(-1);
     }
+    for (std::string line; std::getline(list, line); )
+      if (!line.empty()) files.push_back(line);
+    return files;
+  }
+  DIR * dir = opendir(input.c_str());
+  if (dir == nullptr) {
+    std::cerr << "Error: can't open directory " << input << std::endl;
+    std::exit(-1);
+  }
+  while (auto entry = readdir(dir)) {
+    std::string name{entry->d_name};
+    if ((name.size() > 4) && 
+        ((name.substr(name.size()-4) == ".bmp") || (name.substr(name.size()-4) == ".BMP")))
+      files.push_back(input + "/" + name);
   }
-  it = std::next( buffer.begin(), index );
-  buffer.erase( buffer.begin(), it);
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  return files;
 }
 
-void save_bmp(std::string output_file,
-              int &width, int &height,
-              std::vector<unsigned char> &header_info,
-              std::vector<unsigned char> &red,
-              std::vector<unsigned char> &green,
-              std::vector<unsigned char> &blue)
+// Blurs a batch of images with a pipeline: a reader, a farm of blur
+// workers and a writer that saves the images in input order. Parallelism
+// comes from the farm, so every image is blurred sequentially by its
+// worker. Up to 2*nr_workers images are in flight at the same time.
+int blur_batch(const std::vector<std::string>& inputs, const std::string& output_dir,
+               const std::string& engine, const std::vector<blur_kernel>& kernels,
+               int nr_workers, const grppi::dynamic_execution& exec)
 {
-  // open BMP output file
-  std::ofstream arrayfile( output_file ); // File Creation
-  std::ostream_iterator<unsigned char> output_iterator( arrayfile );
-    
-  // copy header to output file
-  for(auto index=0; index<header_info.size(); index++) {
-    arrayfile << header_info[index];
+  grppi::dynamic_execution worker_exec = grppi::sequential_execution{};
+  in_flight_limit limit{2 * std::max(1, nr_workers)};
+  std::map<int, blur_job> pending;
+  int next_read = 0, next_write = 0;
+
+  grppi::pipeline(exec,
+    [&]() -> std::experimental::optional<blur_job> {
+      if (next_read == inputs.size()) return {};
+      limit.acquire();
+      auto & input = inputs[next_read];
+      blur_job job;
+      job.index = next_read++;
+      job.output_file = output_dir + "/" + input.substr(input.find_last_of('/') + 1);
+      load_bmp(input, job.width, job.height, job.header_info,
+               job.red, job.green, job.blue, worker_exec);
+      return job;
+    },
+    grppi::farm(nr_workers, [&](blur_job job) {
+      std::vector<unsigned char> red(job.red.size()),
+        green(job.green.size()), blue(job.blue.size());
+      channel_views frame{ { job.red.data(), job.green.data(), job.blue.data() },
+                           { red.data(), green.data(), blue.data() },
+                           job.height, job.width };
+      blur_channels(engine, frame, kernels, worker_exec);
+      job.red.swap(red);
+      job.green.swap(green);
+      job.blue.swap(blue);
+      return job;
+    }),
+    [&](blur_job job) {
+      pending.emplace(job.index, std::move(job));
+      for (auto it = pending.begin();
+           (it != pending.end()) && (it->first == next_write);
+           it = pending.erase(it), next_write++) {
+        auto & done = it->second;
+        save_bmp(done.output_file, done.width, done.height, done.header_info,
+                 done.red, done.green, done.blue, worker_exec);
+        limit.release();
+      }
+    });
+
+  return next_write;
+}
+
+// Blurs a batch of video frames in order, blurring again only the areas of
+// every frame that changed from the previous one and reusing the previous
+// output elsewhere. The first frame, and any frame of a new size, is
+// blurred in full. Returns the number of frames, and adds the pixels
+// blurred and the pixels in all the frames to blurred and total.
+int blur_sequence(const std::vector<std::string>& inputs, const std::string& output_dir,
+                  const std::string& engine, const std::vector<blur_kernel>& kernels,
+                  std::size_t& blurred, std::size_t& total,
+                  const grppi::dynamic_execution& exec)
+{
+  int width = 0, height = 0;
+  std::vector<unsigned char> previous[3], result[3], current[3], header_info;
+  for (auto & input : inputs) {
+    int frame_width, frame_height;
+    load_bmp(input, frame_width, frame_height, header_info,
+             current[0], current[1], current[2], exec);
+    bool resized = (frame_width != width) || (frame_height != height);
+    width = frame_width;
+    height = frame_height;
+    for (auto & channel : result) channel.resize(current[0].size());
+
+    channel_views frame{ { current[0].data(), current[1].data(), current[2].data() },
+                         { result[0].data(), result[1].data(), result[2].data() },
+                         height, width };
+    std::vector<region> changed{ { 0, height, 0, width } };
+    if (!resized)
+      changed = changed_regions({ previous[0].data(), previous[1].data(), previous[2].data() },
+                                frame.in, height, width, exec);
+    blurred += blur_incremental(engine, frame,
+      { result[0].data(), result[1].data(), result[2].data() }, changed, kernels, exec);
+    total += (std::size_t) width * height;
+
+    save_bmp(output_dir + "/" + input.substr(input.find_last_of('/') + 1),
+             width, height, header_info, result[0], result[1], result[2], exec);
+    for (int channel = 0; channel < 3; channel++) previous[channel].swap(current[channel]);
   }
-  // copy image to output file
-  int size = 3 * width * height;
-  for(auto row=0; row < height; row++){
-    for(auto colum=0; colum < width; colum++){
-      auto index = (row * width) + colum;
-      arrayfile << blue[index] << green[index] << red[index];
+  return inputs.size();
+}
+
+// Runs of every engine timed by the bench engine, keeping the fastest
+constexpr int bench_runs = 3;
+
+// Times every engine able to run each kernel on its own, so rank and
+// recursive filters can be compared with the convolution engines of a
+// similar window
+void bench_kernels(const channel_views& frame, const std::vector<blur_kernel>& kernels,
+                   const grppi::dynamic_execution& exec)
+{
+  for (auto & kernel : kernels) {
+    std::vector<std::string> engines{ "auto" };
+    if (is_convolution(kernel)) {
+      engines.assign(blur_engines.begin(), blur_engines.end() - 2);
+      if (!is_box_kernel(kernel))
+        engines.erase(std::find(engines.begin(), engines.end(), "box"));
     }
-    if ( 0 != (width*3) % 4 ) {
-      for (int i=0; i < (4 - (width*3)%4); i++) {
-        arrayfile << (unsigned char) 0;
+    for (auto & engine : engines) {
+      long best = 0;
+      for (int run = 0; run < bench_runs; run++) {
+        auto start = std::chrono::system_clock::now();
+        blur_pass(engine, frame, kernel, exec);
+        auto end = std::chrono::system_clock::now();
+        long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end-start).count();
+        if ((run == 0) || (elapsed < best)) best = elapsed;
       }
+      std::cout << kernel.name << " " << (is_convolution(kernel) ? engine :
+        (kernel.sigma > 0) ? "recursive" : "histogram") << ": "
+        << best / 1000.0 << " milliseconds" << std::endl;
     }
   }
 }
@@ -192,39 +1858,142 @@ void save_bmp(std::string output_file,
 int main(int argc, char *argv[])
 {
   // parameters checking
-  if(argc != 6){
+  if(argc < 6 || argc > 8){
     std::cout << "Usage: " << argv[0]
-              << " kernel input output mode nr_threads" << std::endl;
+              << " kernel input output mode nr_threads [engine [strip_mb]]" << std::endl
+              << "  kernel: kernel file, gauss:<sigma>, median:<radius> or"
+              << " percentile:<p>:<radius>, or a comma-separated sequence of"
+              << " them applied in order" << std::endl
+              << "  input/output: BMP files, or an input directory or @list"
+              << " of BMP files and an output directory" << std::endl
+              << "  engine:";
+    for (auto & name : blur_engines) std::cout << " " << name;
+    std::cout << " (default direct; bench times every engine on each kernel)" << std::endl
+              << "  strip_mb: blur out of core in strips using at most"
+              << " strip_mb megabytes, or incremental to blur a batch of video"
+              << " frames in order, only where they changed" << std::endl;
     return -1;
   }
 
   std::string kernel_file(argv[1]), 
   input_file(argv[2]),
-  output_file(argv[3]);
-  auto exec = execution_mode(argv[4], std::stoi(argv[5]));
+  output_file(argv[3]),
+  engine(argc >= 7 ? argv[6] : "direct");
+  int nr_threads = std::stoi(argv[5]);
+  auto exec = execution_mode(argv[4], nr_threads);
+  if (std::find(blur_engines.begin(), blur_engines.end(), engine) == blur_engines.end()) {
+    std::cerr << "Error: unknown engine " << engine << std::endl;
+    return -1;
+  }
 
-  std::vector<int> kernel;
   std::vector<unsigned char> header_info, red, green, blue;
-  int width=0, height=0, kernel_cols;
+  int width=0, height=0;
   std::chrono::time_point<std::chrono::system_clock> start, end;
 
   // load convolution kernel    
-  load_kernel(kernel_file, kernel, kernel_cols);
+  auto kernels = load_kernels(kernel_file);
+  if ((engine == "box") && !std::all_of(kernels.begin(), kernels.end(), is_box_kernel)) {
+    std::cerr << "Error: the box engine requires uniform kernels" << std::endl;
+    return -1;
+  }
+  bool bench = (engine == "bench");
+  if (bench && ((input_file[0] == '@') || is_directory(input_file) || (argc == 8))) {
+    std::cerr << "Error: the bench engine takes a single in-memory image" << std::endl;
+    return -1;
+  }
+
+  // the last argument is incremental for a batch of frames, or a strip
+  // budget in megabytes for a single image
+  bool batch = (input_file[0] == '@') || is_directory(input_file);
+  if (argc == 8) {
+    std::string last(argv[7]);
+    if (batch && (last != "incremental")) {
+      std::cerr << "Error: strips take a single input image" << std::endl;
+      return -1;
+    }
+    if (!batch && (last == "incremental")) {
+      std::cerr << "Error: incremental takes an input directory or @list of frames"
+                << std::endl;
+      return -1;
+    }
+    if (!batch && (last.empty() || (last.size() > 9) ||
+                   (last.find_first_not_of("0123456789") != std::string::npos))) {
+      std::cerr << "Error: strip_mb should be a number of megabytes" << std::endl;
+      return -1;
+    }
+  }
+
+  // blur a sequence of frames, only where they changed
+  if (batch && (argc == 8) && (std::string(argv[7]) == "incremental")) {
+    auto inputs = batch_inputs(input_file);
+    std::size_t blurred = 0, total = 0;
+    start = std::chrono::system_clock::now();
+    int frames = blur_sequence(inputs, output_file, engine, kernels, blurred, total, exec);
+    end = std::chrono::system_clock::now();
+    int elapsed_seconds = std::chrono::duration_cast
+      <std::chrono::milliseconds>(end-start).count();
+    std::cout << "Images: " << frames << std::endl;
+    std::cout << "Blurred pixels: " << (total ? 100.0 * blurred / total : 0) << "%" << std::endl;
+    std::cout << "Execution time: " << elapsed_seconds << " milliseconds" << std::endl;
+    return 0;
+  }
+
+  // stream a batch of images through the pipeline
+  if (batch) {
+    auto inputs = batch_inputs(input_file);
+    start = std::chrono::system_clock::now();
+    int images = blur_batch(inputs, output_file, engine, kernels, nr_threads, exec);
+    end = std::chrono::system_clock::now();
+    int elapsed_seconds = std::chrono::duration_cast
+      <std::chrono::milliseconds>(end-start).count();
+    std::cout << "Images: " << images << std::endl;
+    std::cout << "Execution time: " << elapsed_seconds << " milliseconds" << std::endl;
+    return 0;
+  }
+
+  // blur out of core, strip by strip
+  if (argc == 8) {
+    std::size_t budget = std::stoul(argv[7]) << 20;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long baseline_kb = usage.ru_maxrss;
+    start = std::chrono::system_clock::now();
+    blur_strips(input_file, output_file, engine, kernels, budget, exec);
+    end = std::chrono::system_clock::now();
+    int elapsed_seconds = std::chrono::duration_cast
+      <std::chrono::milliseconds>(end-start).count();
+    std::cout << "Execution time: " << elapsed_seconds << " milliseconds" << std::endl;
+
+    // peak memory of the strips next to the budget, past what the process
+    // used before
+    getrusage(RUSAGE_SELF, &usage);
+    double peak_mb = std::max(0L, usage.ru_maxrss - baseline_kb) / 1024.0;
+    std::cout << "Strip memory: " << peak_mb << " of " << argv[7] << " MB" << std::endl;
+    return 0;
+  }
+
   // load bmp image
-  load_bmp(input_file, width, height, header_info, red, green, blue);
+  load_bmp(input_file, width, height, header_info, red, green, blue, exec);
 
-  // execute blur filter measuring execution time    
-  start = std::chrono::system_clock::now();
+  std::vector<unsigned char> result_red(red.size()), 
+    result_green(green.size()), result_blue(blue.size());
+  channel_views frame{ { red.data(), green.data(), blue.data() },
+                       { result_red.data(), result_green.data(), result_blue.data() },
+                       height, width };
 
-  auto result_red   = blur(red,   width, kernel, kernel_cols, exec);
-  auto result_green = blur(green, width, kernel, kernel_cols, exec);
-  auto result_blue  = blur(blue,  width, kernel, kernel_cols, exec);
+  if (bench) {
+    bench_kernels(frame, kernels, exec);
+    engine = "auto";
+  }
 
+  // execute blur filter measuring execution time    
+  start = std::chrono::system_clock::now();
+  blur_channels(engine, frame, kernels, exec);
   end = std::chrono::system_clock::now();
 
   // save bmp image
   save_bmp(output_file, width, height, header_info,
-   result_red, result_green, result_blue);
+   result_red, result_green, result_blue, exec);
 
   // print preformance results
   int elapsed_seconds = std::chrono::duration_cast
@@ -32,31 +32,602 @@
 #include <string>
 #include <cmath>
 #include <numeric>
+#include <algorithm>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MANDELBROT_X86_SIMD
+#endif
 #include "grppi.h"
 #include "dyn/dynamic_execution.h"
 
 constexpr auto max_iteration = 1000;
+constexpr double poi_x = -0.7, poi_y = 0.0;  // Point of interest
+constexpr double zoom = 0.003; // Mandelbrot zoom
 typedef struct { unsigned char r, g, b; } color;
 int mandelbrot_pixel(std::complex<double> start); 
 color get_color(int iterations);
 
-auto mandelbrot(int width, int height,
+// 24-bit BMP file held in memory: the headers followed by the rows of BGR
+// pixels, each padded to a multiple of four bytes, so the renderers write
+// every row in place and saving is a single write
+struct bitmap {
+  static constexpr int header_size = 14 + 40;
+  int width, height, stride;
+  std::vector<unsigned char> data;
+  unsigned char * row(int y) { return data.data() + header_size + (std::size_t) y * stride; }
+};
+bitmap make_bitmap(int width, int height);
+void save_bmp(std::string filename, const bitmap& image);
+
+// BGR bytes of every iteration count, as given by get_color
+using color_table = std::array<std::array<unsigned char, 3>, max_iteration + 1>;
+
+const color_table& colors()
+{
+  static const color_table table = [] {
+    color_table t;
+    for (int n = 0; n <= max_iteration; n++) {
+      color c = get_color(n);
+      t[n] = { c.b, c.g, c.r };
+    }
+    return t;
+  }();
+  return table;
+}
+
+// Applies op to every index in [0, size) through the GrPPI map pattern
+template <typename Op>
+void map_index(int size, Op && op, const grppi::dynamic_execution& exec)
+{
+  std::vector<int> index(size);
+  std::iota(index.begin(), index.end(), 0);
+  grppi::map(exec, index.begin(), index.end(), index.begin(),
+    [&](int i) { op(i); return i; });
+}
+
+bitmap mandelbrot(int width, int height,
   const grppi::dynamic_execution& exec)
 {
-  double poi_x = -0.7, poi_y = 0.0;  // Point of interest
-  double zoom = 0.003; // Mandelbrot zoom
-  
   // ****** GRPPI code must be placed from here ***** //
-  std::vector<color> image;
-  for (int row= 0; row < height; row++) {
-    for (int col= 0; col < width; col++) {
+  bitmap image = make_bitmap(width, height);
+  map_index(height, [&](int row) {
+    unsigned char * pixel = image.row(row);
+    for (int col= 0; col < width; col++, pixel += 3) {
       std::complex<double> c{ col * zoom + (poi_x - ((width / 2.0) * zoom)),
                               row * zoom + (poi_y - ((height / 2.0) * zoom)) };
-      image.push_back( get_color( mandelbrot_pixel(c) ) );
+      std::memcpy(pixel, colors()[mandelbrot_pixel(c)].data(), 3);
     }
-  }
+  }, exec);
   // ****** to here ***** //
-  return std::move(image);
+  return image;
+}
+
+// Escape-time kernel: for the points c = (col * step + re, im) of the
+// columns [first, last) of a row, stores in iterations[col] the iterations
+// counted as in mandelbrot_pixel, testing |z|^2 against 4 instead of |z|
+// against 2 and squaring z with plain products
+using escape_row = void (*)(double re, double im, double step,
+                            int first, int last, int * iterations);
+
+void escape_row_reference(double re, double im, double step,
+                          int first, int last, int * iterations)
+{
+  for (int col = first; col < last; col++)
+    iterations[col] = mandelbrot_pixel(std::complex<double>{ col * step + re, im });
+}
+
+// Interior checks of the escape-time kernels, which give max_iteration
+// without iterating to the points found inside the set. The bulb check
+// tests membership of the main cardioid and the period-2 bulb. The cycle
+// check compares z with a value saved at iterations 1, 2, 4, 8... and
+// stops once the orbit repeats it exactly, as it would then never escape.
+// Neither changes the counts, so images with and without them compare
+// equal.
+constexpr int interior_bulbs = 1, interior_cycles = 2;
+const std::vector<std::string> interior_checks{ "none", "bulbs", "cycles", "all" };
+
+template <typename T>
+bool in_main_bulbs(T re, T im)
+{
+  T x = re - T(0.25), y2 = im * im;
+  T q = x * x + y2;
+  if (q * (q + x) <= T(0.25) * y2) return true;
+  return (re + 1) * (re + 1) + y2 <= T(0.0625);
+}
+
+template <typename T, int Checks>
+void escape_row_scalar(double re, double im, double step,
+                       int first, int last, int * iterations)
+{
+  for (int col = first; col < last; col++) {
+    T c_re = col * step + re, c_im = im;
+    if ((Checks & interior_bulbs) && in_main_bulbs(c_re, c_im)) {
+      iterations[col] = max_iteration;
+      continue;
+    }
+    T z_re = 0, z_im = 0, saved_re = 0, saved_im = 0;
+    int n = 0, next_save = 1;
+    while ((z_re * z_re + z_im * z_im < 4) && (++n < max_iteration)) {
+      T next_re = z_re * z_re - z_im * z_im + c_re;
+      z_im = 2 * z_re * z_im + c_im;
+      z_re = next_re;
+      if (Checks & interior_cycles) {
+        if ((z_re == saved_re) && (z_im == saved_im)) {
+          n = max_iteration;
+          break;
+        }
+        if (n == next_save) {
+          saved_re = z_re;
+          saved_im = z_im;
+          next_save *= 2;
+        }
+      }
+    }
+    iterations[col] = n;
+  }
+}
+
+// Real parts of the points of Lanes consecutive columns from col, and the
+// mask of the lanes to iterate: those before last not already found in
+// the main bulbs by the bulb check
+template <typename T, int Lanes, int Checks>
+unsigned lane_group(double re, double im, double step, int col, int last, T * reals)
+{
+  unsigned iterate = 0;
+  for (int lane = 0; lane < Lanes; lane++) {
+    reals[lane] = (col + lane) * step + re;
+    if ((col + lane < last) &&
+        !((Checks & interior_bulbs) && in_main_bulbs<T>(reals[lane], im)))
+      iterate |= 1u << lane;
+  }
+  return iterate;
+}
+
+// The vector kernels iterate a group of lanes until all of them escape or
+// reach max_iteration. A lane stops counting once it escapes, and its z
+// goes on changing without further effect. The last group of a row masks
+// out the lanes past its end, so every pixel takes the same vector path
+// wherever the row starts. The build keeps the compiler from fusing
+// multiplications and additions, so every instruction set gives the same
+// counts as the scalar kernel of the same precision.
+#ifdef MANDELBROT_X86_SIMD
+template <int Checks>
+__attribute__((target("avx2")))
+void escape_row_avx2_double(double re, double im, double step,
+                            int first, int last, int * iterations)
+{
+  const __m256d four = _mm256_set1_pd(4), one = _mm256_set1_pd(1);
+  const __m256d maximum = _mm256_set1_pd(max_iteration);
+  const __m256d c_im = _mm256_set1_pd(im);
+  const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1);
+  for (int col = first; col < last; col += 4) {
+    double reals[4];
+    auto iterate = _mm256_set1_epi64x(lane_group<double, 4, Checks>(re, im, step, col, last, reals));
+    __m256d active = _mm256_castsi256_pd(
+      _mm256_cmpeq_epi64(_mm256_and_si256(iterate, bits), bits));
+    __m256d c_re = _mm256_loadu_pd(reals);
+    __m256d z_re = _mm256_setzero_pd(), z_im = _mm256_setzero_pd();
+    __m256d saved_re = z_re, saved_im = z_im;
+    __m256d n = _mm256_andnot_pd(active, maximum);
+    for (int i = 0, next_save = 1; i < max_iteration; i++) {
+      __m256d re2 = _mm256_mul_pd(z_re, z_re), im2 = _mm256_mul_pd(z_im, z_im);
+      active = _mm256_and_pd(active,
+        _mm256_cmp_pd(_mm256_add_pd(re2, im2), four, _CMP_LT_OQ));
+      if (_mm256_movemask_pd(active) == 0) break;
+      n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+      z_im = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(z_re, z_re), z_im), c_im);
+      z_re = _mm256_add_pd(_mm256_sub_pd(re2, im2), c_re);
+      if (Checks & interior_cycles) {
+        __m256d repeated = _mm256_and_pd(active,
+          _mm256_and_pd(_mm256_cmp_pd(z_re, saved_re, _CMP_EQ_OQ),
+                        _mm256_cmp_pd(z_im, saved_im, _CMP_EQ_OQ)));
+        n = _mm256_blendv_pd(n, maximum, repeated);
+        active = _mm256_andnot_pd(repeated, active);
+        if (i + 1 == next_save) {
+          saved_re = z_re;
+          saved_im = z_im;
+          next_save *= 2;
+        }
+      }
+    }
+    int counts[4];
+    _mm_storeu_si128((__m128i*) counts, _mm256_cvtpd_epi32(n));
+    std::copy(counts, counts + std::min(4, last - col), iterations + col);
+  }
+}
+
+template <int Checks>
+__attribute__((target("avx2")))
+void escape_row_avx2_float(double re, double im, double step,
+                           int first, int last, int * iterations)
+{
+  const __m256 four = _mm256_set1_ps(4), one = _mm256_set1_ps(1);
+  const __m256 maximum = _mm256_set1_ps(max_iteration);
+  const __m256 c_im = _mm256_set1_ps(im);
+  const __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  for (int col = first; col < last; col += 8) {
+    float reals[8];
+    auto iterate = _mm256_set1_epi32(lane_group<float, 8, Checks>(re, im, step, col, last, reals));
+    __m256 active = _mm256_castsi256_ps(
+      _mm256_cmpeq_epi32(_mm256_and_si256(iterate, bits), bits));
+    __m256 c_re = _mm256_loadu_ps(reals);
+    __m256 z_re = _mm256_setzero_ps(), z_im = _mm256_setzero_ps();
+    __m256 saved_re = z_re, saved_im = z_im;
+    __m256 n = _mm256_andnot_ps(active, maximum);
+    for (int i = 0, next_save = 1; i < max_iteration; i++) {
+      __m256 re2 = _mm256_mul_ps(z_re, z_re), im2 = _mm256_mul_ps(z_im, z_im);
+      active = _mm256_and_ps(active,
+        _mm256_cmp_ps(_mm256_add_ps(re2, im2), four, _CMP_LT_OQ));
+      if (_mm256_movemask_ps(active) == 0) break;
+      n = _mm256_add_ps(n, _mm256_and_ps(active, one));
+      z_im = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(z_re, z_re), z_im), c_im);
+      z_re = _mm256_add_ps(_mm256_sub_ps(re2, im2), c_re);
+      if (Checks & interior_cycles) {
+        __m256 repeated = _mm256_and_ps(active,
+          _mm256_and_ps(_mm256_cmp_ps(z_re, saved_re, _CMP_EQ_OQ),
+                        _mm256_cmp_ps(z_im, saved_im, _CMP_EQ_OQ)));
+        n = _mm256_blendv_ps(n, maximum, repeated);
+        active = _mm256_andnot_ps(repeated, active);
+        if (i + 1 == next_save) {
+          saved_re = z_re;
+          saved_im = z_im;
+          next_save *= 2;
+        }
+      }
+    }
+    int counts[8];
+    _mm256_storeu_si256((__m256i*) counts, _mm256_cvtps_epi32(n));
+    std::copy(counts, counts + std::min(8, last - col), iterations + col);
+  }
+}
+
+template <int Checks>
+__attribute__((target("avx512f")))
+void escape_row_avx512_double(double re, double im, double step,
+                              int first, int last, int * iterations)
+{
+  const __m512d four = _mm512_set1_pd(4), one = _mm512_set1_pd(1);
+  const __m512d maximum = _mm512_set1_pd(max_iteration);
+  const __m512d c_im = _mm512_set1_pd(im);
+  for (int col = first; col < last; col += 8) {
+    double reals[8];
+    __mmask8 active = lane_group<double, 8, Checks>(re, im, step, col, last, reals);
+    __m512d c_re = _mm512_loadu_pd(reals);
+    __m512d z_re = _mm512_setzero_pd(), z_im = _mm512_setzero_pd();
+    __m512d saved_re = z_re, saved_im = z_im;
+    __m512d n = _mm512_mask_mov_pd(maximum, active, _mm512_setzero_pd());
+    for (int i = 0, next_save = 1; i < max_iteration; i++) {
+      __m512d re2 = _mm512_mul_pd(z_re, z_re), im2 = _mm512_mul_pd(z_im, z_im);
+      active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(re2, im2), four, _CMP_LT_OQ);
+      if (active == 0) break;
+      n = _mm512_mask_add_pd(n, active, n, one);
+      z_im = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(z_re, z_re), z_im), c_im);
+      z_re = _mm512_add_pd(_mm512_sub_pd(re2, im2), c_re);
+      if (Checks & interior_cycles) {
+        __mmask8 repeated = _mm512_mask_cmp_pd_mask(
+          _mm512_mask_cmp_pd_mask(active, z_re, saved_re, _CMP_EQ_OQ),
+          z_im, saved_im, _CMP_EQ_OQ);
+        n = _mm512_mask_mov_pd(n, repeated, maximum);
+        active &= ~repeated;
+        if (i + 1 == next_save) {
+          saved_re = z_re;
+          saved_im = z_im;
+          next_save *= 2;
+        }
+      }
+    }
+    int counts[8];
+    _mm256_storeu_si256((__m256i*) counts, _mm512_cvtpd_epi32(n));
+    std::copy(counts, counts + std::min(8, last - col), iterations + col);
+  }
+}
+
+template <int Checks>
+__attribute__((target("avx512f")))
+void escape_row_avx512_float(double re, double im, double step,
+                             int first, int last, int * iterations)
+{
+  const __m512 four = _mm512_set1_ps(4), one = _mm512_set1_ps(1);
+  const __m512 maximum = _mm512_set1_ps(max_iteration);
+  const __m512 c_im = _mm512_set1_ps(im);
+  for (int col = first; col < last; col += 16) {
+    float reals[16];
+    __mmask16 active = lane_group<float, 16, Checks>(re, im, step, col, last, reals);
+    __m512 c_re = _mm512_loadu_ps(reals);
+    __m512 z_re = _mm512_setzero_ps(), z_im = _mm512_setzero_ps();
+    __m512 saved_re = z_re, saved_im = z_im;
+    __m512 n = _mm512_mask_mov_ps(maximum, active, _mm512_setzero_ps());
+    for (int i = 0, next_save = 1; i < max_iteration; i++) {
+      __m512 re2 = _mm512_mul_ps(z_re, z_re), im2 = _mm512_mul_ps(z_im, z_im);
+      active = _mm512_mask_cmp_ps_mask(active, _mm512_add_ps(re2, im2), four, _CMP_LT_OQ);
+      if (active == 0) break;
+      n = _mm512_mask_add_ps(n, active, n, one);
+      z_im = _mm512_add_ps(_mm512_mul_ps(_mm512_add_ps(z_re, z_re), z_im), c_im);
+      z_re = _mm512_add_ps(_mm512_sub_ps(re2, im2), c_re);
+      if (Checks & interior_cycles) {
+        __mmask16 repeated = _mm512_mask_cmp_ps_mask(
+          _mm512_mask_cmp_ps_mask(active, z_re, saved_re, _CMP_EQ_OQ),
+          z_im, saved_im, _CMP_EQ_OQ);
+        n = _mm512_mask_mov_ps(n, repeated, maximum);
+        active &= ~repeated;
+        if (i + 1 == next_save) {
+          saved_re = z_re;
+          saved_im = z_im;
+          next_save *= 2;
+        }
+      }
+    }
+    int counts[16];
+    _mm512_storeu_si512(counts, _mm512_cvtps_epi32(n));
+    std::copy(counts, counts + std::min(16, last - col), iterations + col);
+  }
+}
+#endif
+
+// Widest escape-time kernel with the given interior checks, in single or
+// double precision, supported by the running processor
+template <int Checks>
+escape_row select_escape_row(bool single)
+{
+#ifdef MANDELBROT_X86_SIMD
+  if (__builtin_cpu_supports("avx512f"))
+    return single ? escape_row_avx512_float<Checks> : escape_row_avx512_double<Checks>;
+  if (__builtin_cpu_supports("avx2"))
+    return single ? escape_row_avx2_float<Checks> : escape_row_avx2_double<Checks>;
+#endif
+  return single ? escape_row_scalar<float, Checks> : escape_row_scalar<double, Checks>;
+}
+
+// Picks the kernel of the given precision, double or float, with the
+// given interior checks, or the reference one
+escape_row select_escape_row(const std::string& precision, int checks)
+{
+  if (precision == "reference") return escape_row_reference;
+  bool single = (precision == "float");
+  switch (checks) {
+    case interior_bulbs: return select_escape_row<interior_bulbs>(single);
+    case interior_cycles: return select_escape_row<interior_cycles>(single);
+    case interior_bulbs | interior_cycles:
+      return select_escape_row<interior_bulbs | interior_cycles>(single);
+    default: return select_escape_row<0>(single);
+  }
+}
+
+// Colours of the iteration counts of an image
+bitmap colorize(const std::vector<int>& iterations, int width, int height,
+  const grppi::dynamic_execution& exec)
+{
+  bitmap image = make_bitmap(width, height);
+  const auto & table = colors();
+  map_index(height, [&](int row) {
+    const int * count = iterations.data() + (std::size_t) row * width;
+    unsigned char * pixel = image.row(row);
+    for (int col = 0; col < width; col++, pixel += 3)
+      std::memcpy(pixel, table[count[col]].data(), 3);
+  }, exec);
+  return image;
+}
+
+// Vectorised rendering: every row goes through the escape-time kernel,
+// with the rows distributed through the GrPPI execution
+bitmap mandelbrot_rows(int width, int height, escape_row kernel,
+  const grppi::dynamic_execution& exec)
+{
+  std::vector<int> iterations((std::size_t) width * height);
+  double re = poi_x - ((width / 2.0) * zoom);
+  map_index(height, [&](int row) {
+    kernel(re, row * zoom + (poi_y - ((height / 2.0) * zoom)), zoom,
+           0, width, iterations.data() + (std::size_t) row * width);
+  }, exec);
+  return colorize(iterations, width, height, exec);
+}
+
+// Orders in which the tile scheduler hands out the tiles
+const std::vector<std::string> tile_orders{ "row", "morton", "spiral" };
+
+// Interleaves the bits of x and y into the position along a Z-order curve
+std::uint32_t morton_key(std::uint32_t x, std::uint32_t y)
+{
+  std::uint32_t key = 0;
+  for (int bit = 0; bit < 16; bit++)
+    key |= (((x >> bit) & 1) << (2 * bit)) | (((y >> bit) & 1) << (2 * bit + 1));
+  return key;
+}
+
+// Tiles of an across x down grid, numbered in row order, listed in the
+// given order: by rows, along a Z-order curve, or along a square spiral
+// from the centre, where the costly points of the set gather
+std::vector<int> order_tiles(int across, int down, const std::string& order)
+{
+  std::vector<int> tiles(across * down);
+  std::iota(tiles.begin(), tiles.end(), 0);
+  if (order == "morton") {
+    std::stable_sort(tiles.begin(), tiles.end(), [&](int a, int b) {
+      return morton_key(a % across, a / across) < morton_key(b % across, b / across);
+    });
+  }
+  else if (order == "spiral") {
+    tiles.clear();
+    int x = (across - 1) / 2, y = (down - 1) / 2;
+    int dx = 1, dy = 0;
+    for (int leg = 1; tiles.size() < across * down; leg++) {
+      // legs of 1, 1, 2, 2, 3, 3... steps turning clockwise
+      for (int turn = 0; turn < 2; turn++) {
+        for (int step = 0; step < leg; step++) {
+          if ((x >= 0) && (x < across) && (y >= 0) && (y < down))
+            tiles.push_back(y * across + x);
+          x += dx;
+          y += dy;
+        }
+        std::swap(dx, dy);
+        dx = -dx;
+      }
+    }
+  }
+  return tiles;
+}
+
+// Time spent rendering and tiles rendered and stolen by one worker of the
+// tile scheduler
+struct tile_stats {
+  double busy_ms = 0;
+  int tiles = 0;
+  int stolen = 0;
+};
+
+// Part [first, last) of the ordered tiles still queued for one worker
+struct tile_queue {
+  std::mutex lock;
+  int first = 0, last = 0;
+};
+
+// Tiled rendering with work stealing. Every worker starts with an equal,
+// contiguous part of the ordered tiles and takes them from the front;
+// once it runs out it steals the back half of the part of another worker.
+// The workers run through the GrPPI execution, and stats gets their
+// busy time.
+bitmap mandelbrot_tiles(int width, int height, escape_row kernel,
+  int tile, const std::string& order, int nr_workers, std::vector<tile_stats>& stats,
+  const grppi::dynamic_execution& exec)
+{
+  int across = (width + tile - 1) / tile, down = (height + tile - 1) / tile;
+  auto tiles = order_tiles(across, down, order);
+  std::vector<tile_queue> queues(nr_workers);
+  for (int worker = 0; worker < nr_workers; worker++) {
+    queues[worker].first = (long) tiles.size() * worker / nr_workers;
+    queues[worker].last = (long) tiles.size() * (worker + 1) / nr_workers;
+  }
+  stats.assign(nr_workers, tile_stats{});
+
+  std::vector<int> iterations((std::size_t) width * height);
+  double re = poi_x - ((width / 2.0) * zoom);
+  auto render = [&](int index) {
+    int top = (index / across) * tile, left = (index % across) * tile;
+    for (int row = top; row < std::min(top + tile, height); row++)
+      kernel(re, row * zoom + (poi_y - ((height / 2.0) * zoom)), zoom,
+             left, std::min(left + tile, width),
+             iterations.data() + (std::size_t) row * width);
+  };
+
+  map_index(nr_workers, [&](int worker) {
+    auto & own = queues[worker];
+    for (;;) {
+      int next = -1;
+      {
+        std::lock_guard<std::mutex> guard{own.lock};
+        if (own.first < own.last) next = tiles[own.first++];
+      }
+      for (int k = 1; (next < 0) && (k < nr_workers); k++) {
+        auto & victim = queues[(worker + k) % nr_workers];
+        int first, last;
+        {
+          std::lock_guard<std::mutex> guard{victim.lock};
+          if (victim.first == victim.last) continue;
+          last = victim.last;
+          first = victim.last = last - (last - victim.first + 1) / 2;
+        }
+        stats[worker].stolen += last - first;
+        std::lock_guard<std::mutex> guard{own.lock};
+        own.first = first + 1;
+        own.last = last;
+        next = tiles[first];
+      }
+      if (next < 0) break;
+      auto start = std::chrono::steady_clock::now();
+      render(next);
+      auto end = std::chrono::steady_clock::now();
+      stats[worker].busy_ms += std::chrono::duration<double, std::milli>(end - start).count();
+      stats[worker].tiles++;
+    }
+  }, exec);
+
+  return colorize(iterations, width, height, exec);
+}
+
+// Rectangle [top, bottom) x [left, right) of the image whose border pixels
+// already hold their iteration counts. Whether that border has a single
+// count is checked once, by the split predicate or the solver, and kept in
+// uniform (-1 until checked).
+struct block {
+  int top, bottom, left, right;
+  mutable int uniform = -1;
+};
+
+// Smallest inside of a rectangle split by the Mariani-Silver renderer
+constexpr int mariani_min_side = 16;
+
+// Mariani-Silver rendering: the set is connected, so a rectangle whose
+// border has a single iteration count is filled with it without iterating
+// its inside. Other rectangles are split in four along their middle row
+// and column, which are iterated first so every part starts with a known
+// border, until the inside gets narrower than min_side and is iterated.
+// The subdivision runs through grppi::divide_conquer, and filled gets the
+// number of pixels filled without iterating.
+bitmap mandelbrot_mariani(int width, int height, escape_row kernel,
+  int min_side, std::size_t& filled, const grppi::dynamic_execution& exec)
+{
+  std::vector<int> iterations((std::size_t) width * height);
+  double re = poi_x - ((width / 2.0) * zoom);
+  auto line = [&](int row) { return iterations.data() + (std::size_t) row * width; };
+  auto span = [&](int row, int first, int last) {
+    kernel(re, row * zoom + (poi_y - ((height / 2.0) * zoom)), zoom, first, last, line(row));
+  };
+  auto column = [&](int col, int top, int bottom) {
+    for (int row = top; row < bottom; row++) span(row, col, col + 1);
+  };
+  auto border = [&](const block& b) {
+    int value = line(b.top)[b.left];
+    for (int col = b.left; col < b.right; col++)
+      if ((line(b.top)[col] != value) || (line(b.bottom - 1)[col] != value)) return false;
+    for (int row = b.top + 1; row < b.bottom - 1; row++)
+      if ((line(row)[b.left] != value) || (line(row)[b.right - 1] != value)) return false;
+    return true;
+  };
+  auto uniform = [&](const block& b) {
+    if (b.uniform < 0) b.uniform = border(b) ? 1 : 0;
+    return b.uniform == 1;
+  };
+
+  // border of the whole image
+  span(0, 0, width);
+  if (height > 1) span(height - 1, 0, width);
+  column(0, 1, height - 1);
+  if (width > 1) column(width - 1, 1, height - 1);
+
+  filled = grppi::divide_conquer(exec, block{ 0, height, 0, width },
+    [&](const block& b) {
+      int middle_row = (b.top + b.bottom) / 2, middle_col = (b.left + b.right) / 2;
+      span(middle_row, b.left + 1, b.right - 1);
+      column(middle_col, b.top + 1, middle_row);
+      column(middle_col, middle_row + 1, b.bottom - 1);
+      return std::vector<block>{
+        { b.top, middle_row + 1, b.left, middle_col + 1 },
+        { b.top, middle_row + 1, middle_col, b.right },
+        { middle_row, b.bottom, b.left, middle_col + 1 },
+        { middle_row, b.bottom, middle_col, b.right } };
+    },
+    [&](const block& b) {
+      return (b.bottom - b.top - 2 < min_side) || (b.right - b.left - 2 < min_side) ||
+             uniform(b);
+    },
+    [&](const block& b) -> std::size_t {
+      if ((b.bottom - b.top <= 2) || (b.right - b.left <= 2)) return 0;
+      if (uniform(b)) {
+        int value = line(b.top)[b.left];
+        for (int row = b.top + 1; row < b.bottom - 1; row++)
+          std::fill(line(row) + b.left + 1, line(row) + b.right - 1, value);
+        return (std::size_t) (b.bottom - b.top - 2) * (b.right - b.left - 2);
+      }
+      for (int row = b.top + 1; row < b.bottom - 1; row++) span(row, b.left + 1, b.right - 1);
+      return 0;
+    },
+    [](std::size_t a, std::size_t b) { return a + b; });
+
+  return colorize(iterations, width, height, exec);
 }
 
 grppi::dynamic_execution execution_mode(const std::string & opt, int nr_threads) 
@@ -112,9 +683,7 @@ color get_color(int iterations)
     return color{(unsigned char)r, (unsigned char)g, (unsigned char)b};
 }
 
-void save_bmp(std::string filename, 
-              int width, int height, 
-              std::vector<color>& img)
+bitmap make_bitmap(int width, int height)
 {
   unsigned char file[14] = {
     'B','M', // magic
@@ -161,54 +730,125 @@ void save_bmp(std::string filename,
   info[22] = (unsigned char)( sizeData>>16);
   info[23] = (unsigned char)( sizeData>>24);
 
+  bitmap image{ width, height, width*3 + padSize };
+  image.data.resize(sizeAll);
+  std::copy(file, file + sizeof(file), image.data.begin());
+  std::copy(info, info + sizeof(info), image.data.begin() + sizeof(file));
+  return image;
+}
+
+void save_bmp(std::string filename, const bitmap& image)
+{
   std::fstream stream;
-  stream.open( filename, std::fstream::out );
-  stream.write( (char*)file, sizeof(file) );
-  stream.write( (char*)info, sizeof(info) );
-
-  unsigned char pad[3] = {0,0,0};
-
-  for ( int y=0; y<height; y++ ) {
-    for ( int x=0; x<width; x++ ) {
-      unsigned char pixel[3];
-      pixel[0] = img[y*width+x].b;
-      pixel[1] = img[y*width+x].g;
-      pixel[2] = img[y*width+x].r;
-      stream.write( (char*)pixel, 3 );
-    }
-    stream.write( (char*)pad, padSize );
-  }
+  stream.open( filename, std::fstream::out | std::fstream::binary );
+  stream.write( (const char*)image.data.data(), image.data.size() );
   stream.close();
 }
 
 int main(int argc, char *argv[])
 {
   // parameters checking
-  if(argc != 6){
+  if(argc < 6 || argc > 10){
     std::cout << "Usage: " << argv[0] 
-              << " width height output mode nr_threads" << std::endl;
+              << " width height output mode nr_threads [kernel [layout [order [interior]]]]"
+              << std::endl
+              << "  kernel: reference, or the vectorised double or float"
+              << " (default reference)" << std::endl
+              << "  layout: 0 to render by rows, the side of the tiles of the"
+              << " work-stealing scheduler, or mariani[:min_side] for"
+              << " Mariani-Silver subdivision" << std::endl
+              << "  order:";
+    for (auto & name : tile_orders) std::cout << " " << name;
+    std::cout << " (default row)" << std::endl
+              << "  interior: checks of the vectorised kernels for points inside"
+              << " the set:";
+    for (auto & name : interior_checks) std::cout << " " << name;
+    std::cout << " (default none)" << std::endl;
     return -1;
   }
   int width{std::stoi(argv[1])};
   int height{std::stoi(argv[2])};    
   std::string output_file{argv[3]};
   auto exec = execution_mode(argv[4], std::stoi(argv[5]));
+  std::string kernel{argc >= 7 ? argv[6] : "reference"};
+  if ((kernel != "reference") && (kernel != "double") && (kernel != "float")) {
+    std::cerr << "Error: unknown kernel " << kernel << std::endl;
+    return -1;
+  }
+  int nr_threads = std::stoi(argv[5]);
+  std::string layout{argc >= 8 ? argv[7] : "0"};
+  int tile = 0, min_side = 0;
+  if (layout.compare(0, 7, "mariani") == 0) {
+    min_side = (layout.size() > 8) ? std::stoi(layout.substr(8)) : mariani_min_side;
+    if (min_side < 1) {
+      std::cerr << "Error: Mariani-Silver minimum side should be positive" << std::endl;
+      return -1;
+    }
+  }
+  else tile = std::stoi(layout);
+  std::string order{argc >= 9 ? argv[8] : "row"};
+  std::string interior{argc == 10 ? argv[9] : "none"};
+  if (tile < 0) {
+    std::cerr << "Error: tile side should not be negative" << std::endl;
+    return -1;
+  }
+  if (std::find(tile_orders.begin(), tile_orders.end(), order) == tile_orders.end()) {
+    std::cerr << "Error: unknown tile order " << order << std::endl;
+    return -1;
+  }
+  auto check = std::find(interior_checks.begin(), interior_checks.end(), interior);
+  if (check == interior_checks.end()) {
+    std::cerr << "Error: unknown interior check " << interior << std::endl;
+    return -1;
+  }
+  int checks = check - interior_checks.begin();
+  if ((checks != 0) && (kernel == "reference")) {
+    std::cerr << "Error: interior checks need the double or float kernel" << std::endl;
+    return -1;
+  }
+  std::vector<tile_stats> stats;
+  std::size_t filled = 0;
 
   std::chrono::time_point<std::chrono::system_clock> start, end;
 
   // execute mandelbrot measuring execution time    
   start = std::chrono::system_clock::now();
-  auto image = mandelbrot(width, height, exec);
+  auto image = (min_side > 0) ?
+    mandelbrot_mariani(width, height, select_escape_row(kernel, checks), min_side,
+                       filled, exec) :
+    (tile > 0) ?
+    mandelbrot_tiles(width, height, select_escape_row(kernel, checks), tile, order,
+                     std::max(1, nr_threads), stats, exec) :
+    (kernel == "reference") ? mandelbrot(width, height, exec) :
+    mandelbrot_rows(width, height, select_escape_row(kernel, checks), exec);
   end = std::chrono::system_clock::now();
 
   // save bmp image
-  save_bmp(output_file, width, height, image);
+  save_bmp(output_file, image);
 
   // print preformance results
   int elapsed_seconds = 
     std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
     
   std::cout << "Execution time: " << elapsed_seconds << " milliseconds" << std::endl;
+
+  if (min_side > 0)
+    std::cout << "Filled without iterating: "
+              << 100.0 * filled / ((double) width * height) << "%" << std::endl;
+
+  // load balance of the tile scheduler
+  if (!stats.empty()) {
+    double total = 0, longest = 0;
+    for (int worker = 0; worker < stats.size(); worker++) {
+      std::cout << "Thread " << worker << ": busy " << stats[worker].busy_ms
+                << " milliseconds, " << stats[worker].tiles << " tiles, "
+                << stats[worker].stolen << " stolen" << std::endl;
+      total += stats[worker].busy_ms;
+      longest = std::max(longest, stats[worker].busy_ms);
+    }
+    std::cout << "Load balance: " << (longest > 0 ? 100 * total / (stats.size() * longest) : 100)
+              << "%" << std::endl;
+  }
     
   return 0;
 }
@@ -31,6 +31,18 @@
 #include <string>
 #include <signal.h>
 #include <iomanip>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <fcntl.h>
+#include <experimental/optional>
 #include "grppi.h"
 #include "dyn/dynamic_execution.h"
 
@@ -47,21 +59,418 @@ char ascii_map[70]= {'$','@','B','%','8','&','W','M','#',
 std::string color[3] = {"\033[1;33m", "\033[1;31m", "\033[1;35m"};
 
 constexpr auto max_iteration = 1000, max_frames= 3000;
+const std::vector<std::string> engines{ "double", "perturbation" };
+const std::vector<std::string> displays{ "full", "delta", "y4m", "rgb" };
+
+// Frames in flight are limited to what fits in this many bytes of
+// iteration counts, so high resolutions do not exhaust the memory
+constexpr std::size_t frame_memory_budget = std::size_t{256} << 20;
+
+// How the video is rendered and shown. With reuse, every frame starts
+// from the counts of the previous one, moved to the new zoom, and only
+// iterates the pixels whose source neighbourhood spans more than
+// tolerance iterations; validate also renders every frame in full to
+// measure the error. Headless runs play a fixed number of frames without
+// pacing, writing them to output, to the standard output when it is "-",
+// or nowhere when it is empty.
+struct video_options {
+  std::string engine = "double";
+  std::string display = "full";
+  bool reuse = false;
+  int tolerance = 0;
+  bool validate = false;
+  bool headless = false;
+  int frames = max_frames + 1;
+  std::string output;
+};
+
+// Character cell of the terminal: a glyph of ascii_map in one of the colours
+struct cell {
+  unsigned char color;
+  char glyph;
+};
+
+typedef struct { unsigned char r, g, b; } rgb;
 
 double mandelbrot_pixel(std::complex<double> start); 
-std::string get_color(double iterations);
+std::vector<std::complex<double>> reference_orbit(double re, double im);
+double perturbed_pixel(std::complex<double> delta,
+  const std::vector<std::complex<double>>& orbit);
+cell get_color(double iterations);
+rgb get_rgb(int iterations);
 std::string get_stats(
   time_point<system_clock> start, 
   time_point<system_clock> end,
   time_point<system_clock> init,
   std::vector<time_point<system_clock>>& frame_times, 
   int& current, int& frames);
+std::string get_summary(std::vector<double> latencies,
+  time_point<system_clock> first, time_point<system_clock> last);
 
 bool finalize = false;
 
 void signal_callback_handler(int signum) { finalize = true; }
 
-void mandelbrot(int width, int height,
+// Bounds the number of frames in flight in the video pipeline
+class in_flight_limit {
+public:
+  explicit in_flight_limit(int size) : free_{size} {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    released_.wait(lock, [this] { return free_ > 0; });
+    free_--;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      free_++;
+    }
+    released_.notify_one();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable released_;
+  int free_;
+};
+
+// One frame travelling through the video pipeline: the zoom set by the
+// generator, when it did so, and the iteration counts the farm renders
+struct video_frame {
+  int index;
+  double zoom;
+  time_point<system_clock> created;
+  std::vector<int> iterations;
+};
+
+// Encodes frames of iteration counts as terminal output. The cells come
+// from a table built once from get_color, and the bytes go to a buffer
+// reused for every frame. A colour escape is written only when the colour
+// changes, and spaces keep whatever colour is set. In delta mode only the
+// cells that differ from the previous frame are drawn, reached with cursor
+// moves; unchanged gaps shorter than a cursor move are drawn again.
+class frame_encoder {
+public:
+  explicit frame_encoder(bool delta) : delta_{delta}
+  {
+    for (int n = 0; n <= max_iteration; n++) cells_[n] = get_color(n);
+  }
+
+  // Output for a frame drawn from the second line of the terminal on
+  const std::string& encode(const std::vector<int>& iterations, int width, int height)
+  {
+    constexpr int max_gap = 8;
+    buffer_.clear();
+    buffer_.reserve((std::size_t) width * height * 8 + height * 16 + 16);
+    color_ = -1;
+    bool full = !delta_ || (previous_.size() != iterations.size());
+    if (full) append_move(0, 0);
+    for (int row = 0; row < height; row++) {
+      const int * line = iterations.data() + (std::size_t) row * width;
+      if (full) {
+        append_cells(line, 0, width);
+        buffer_ += '\n';
+        continue;
+      }
+      const int * before = previous_.data() + (std::size_t) row * width;
+      for (int col = 0; col < width; ) {
+        if (same(line[col], before[col])) {
+          col++;
+          continue;
+        }
+        int first = col, last = col + 1;
+        for (col++; (col < width) && (col - last < max_gap); col++)
+          if (!same(line[col], before[col])) last = col + 1;
+        append_move(row, first);
+        append_cells(line, first, last);
+        col = last;
+      }
+    }
+    if (color_ >= 0) buffer_ += "\033[0m";
+    previous_.assign(iterations.begin(), iterations.end());
+    return buffer_;
+  }
+
+private:
+  bool same(int a, int b) const
+  {
+    return (cells_[a].glyph == cells_[b].glyph) &&
+           ((cells_[a].color == cells_[b].color) || (cells_[a].glyph == ' '));
+  }
+
+  void append_cells(const int * line, int first, int last)
+  {
+    for (int col = first; col < last; col++) {
+      const cell & c = cells_[line[col]];
+      if ((c.color != color_) && (c.glyph != ' ')) {
+        buffer_ += color[c.color];
+        color_ = c.color;
+      }
+      buffer_ += c.glyph;
+    }
+  }
+
+  // cursor to a cell of the frame, below the stats line
+  void append_move(int row, int col)
+  {
+    buffer_ += "\033[";
+    append_number(row + 2);
+    buffer_ += ';';
+    append_number(col + 1);
+    buffer_ += 'H';
+  }
+
+  void append_number(int value)
+  {
+    char digits[12];
+    int size = 0;
+    do {
+      digits[size++] = '0' + value % 10;
+      value /= 10;
+    } while (value > 0);
+    while (size > 0) buffer_ += digits[--size];
+  }
+
+  bool delta_;
+  std::array<cell, max_iteration + 1> cells_;
+  std::string buffer_;
+  std::vector<int> previous_;
+  int color_ = -1;
+};
+
+// Encodes frames of iteration counts as raw video in the colours of the
+// mandelbrot image: packed 24-bit RGB, or YUV4MPEG2 in 4:4:4 BT.601 with
+// the stream header before the first frame. Both come from tables built
+// once per iteration count.
+class video_encoder {
+public:
+  video_encoder(bool y4m, int width, int height) :
+    y4m_{y4m}, width_{width}, height_{height}
+  {
+    for (int n = 0; n <= max_iteration; n++) {
+      rgb c = get_rgb(n);
+      rgb_[n] = { c.r, c.g, c.b };
+      yuv_[n] = {
+        (unsigned char) std::lround(16 + (65.481 * c.r + 128.553 * c.g + 24.966 * c.b) / 255),
+        (unsigned char) std::lround(128 + (-37.797 * c.r - 74.203 * c.g + 112.0 * c.b) / 255),
+        (unsigned char) std::lround(128 + (112.0 * c.r - 93.786 * c.g - 18.214 * c.b) / 255) };
+    }
+  }
+
+  void encode(const std::vector<int>& iterations, std::vector<unsigned char>& buffer)
+  {
+    std::string header;
+    if (y4m_) {
+      if (!started_)
+        header = "YUV4MPEG2 W" + std::to_string(width_) + " H" + std::to_string(height_) +
+                 " F30:1 Ip A1:1 C444\n";
+      header += "FRAME\n";
+    }
+    started_ = true;
+    std::size_t pixels = iterations.size();
+    buffer.resize(header.size() + 3 * pixels);
+    std::copy(header.begin(), header.end(), buffer.begin());
+    unsigned char * out = buffer.data() + header.size();
+    if (y4m_) {
+      for (std::size_t i = 0; i < pixels; i++) {
+        auto & yuv = yuv_[iterations[i]];
+        out[i] = yuv[0];
+        out[pixels + i] = yuv[1];
+        out[2 * pixels + i] = yuv[2];
+      }
+    }
+    else {
+      for (std::size_t i = 0; i < pixels; i++, out += 3)
+        std::copy(rgb_[iterations[i]].begin(), rgb_[iterations[i]].end(), out);
+    }
+  }
+
+private:
+  bool y4m_, started_ = false;
+  int width_, height_;
+  std::array<std::array<unsigned char, 3>, max_iteration + 1> rgb_, yuv_;
+};
+
+// Writes frames to a file descriptor from a thread of its own through two
+// buffers: the display stage fills one while the other is being written,
+// so it only waits for the disk when it gets two frames ahead of it
+class frame_writer {
+public:
+  frame_writer(int fd, const std::string& name) :
+    fd_{fd}, name_{name}, writer_{[this] { run(); }} {}
+
+  ~frame_writer() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      done_ = true;
+    }
+    changed_.notify_all();
+    writer_.join();
+  }
+
+  // Buffer for the next frame, once its previous contents are written
+  std::vector<unsigned char>& next() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this] { return !full_[fill_]; });
+    return buffers_[fill_];
+  }
+
+  // Queues the buffer returned by next for writing
+  void submit() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      full_[fill_] = true;
+      fill_ ^= 1;
+    }
+    changed_.notify_all();
+  }
+
+private:
+  void run() {
+    for (int index = 0; ; index ^= 1) {
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+        changed_.wait(lock, [&] { return full_[index] || done_; });
+        if (!full_[index]) return;
+      }
+      const unsigned char * data = buffers_[index].data();
+      std::size_t size = buffers_[index].size();
+      while (size > 0) {
+        auto written = write(fd_, data, size);
+        if (written < 0) {
+          std::cerr << "Error: can't write file " << name_ << std::endl;
+          std::exit(-1);
+        }
+        data += written;
+        size -= written;
+      }
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        full_[index] = false;
+      }
+      changed_.notify_all();
+    }
+  }
+
+  int fd_;
+  std::string name_;
+  std::vector<unsigned char> buffers_[2];
+  bool full_[2] = { false, false };
+  int fill_ = 0;
+  bool done_ = false;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::thread writer_;
+};
+
+// Applies op to every index in [0, size) through the GrPPI map pattern
+template <typename Op>
+void map_index(int size, Op && op, const grppi::dynamic_execution& exec)
+{
+  std::vector<int> index(size);
+  std::iota(index.begin(), index.end(), 0);
+  grppi::map(exec, index.begin(), index.end(), index.begin(),
+    [&](int i) { op(i); return i; });
+}
+
+// Rows of the blocks in which a frame is reprojected and rendered
+constexpr int frame_block_rows = 8;
+
+// Counts of the previous frame, of zoom previous_zoom, moved to the pixels
+// of a frame of the given zoom around the same point. A pixel takes the
+// count of the nearest source pixel if the 3x3 source pixels around it
+// are in the old view and within tolerance iterations of each other, and
+// -1 otherwise. Blocks of rows are reprojected in parallel through exec.
+std::vector<int> reproject(const std::vector<int>& previous, int width, int height,
+  double previous_zoom, double zoom, int tolerance,
+  const grppi::dynamic_execution& exec)
+{
+  std::vector<int> image((std::size_t) width * height, -1);
+  double scale = zoom / previous_zoom;
+  auto source = [scale](int index, int size) {
+    int nearest = std::lround((index - size / 2.0) * scale + size / 2.0);
+    return ((nearest < 1) || (nearest > size - 2)) ? -1 : nearest;
+  };
+  std::vector<int> source_cols(width);
+  for (int col = 0; col < width; col++) source_cols[col] = source(col, width);
+
+  int blocks = (height + frame_block_rows - 1) / frame_block_rows;
+  map_index(blocks, [&](int block) {
+    // spread of the 3x3 neighbourhood of every pixel of a source row,
+    // taking the minimum and maximum down the columns first
+    std::vector<int> low(width), high(width), spread(width);
+    int last = std::min(height, (block + 1) * frame_block_rows);
+    for (int row = block * frame_block_rows; row < last; row++) {
+      int source_row = source(row, height);
+      if (source_row < 0) continue;
+      const int * middle = previous.data() + (std::size_t) source_row * width;
+      const int * above = middle - width, * below = middle + width;
+      for (int c = 0; c < width; c++) {
+        low[c] = std::min(std::min(above[c], middle[c]), below[c]);
+        high[c] = std::max(std::max(above[c], middle[c]), below[c]);
+      }
+      for (int c = 1; c < width - 1; c++)
+        spread[c] = std::max(std::max(high[c - 1], high[c]), high[c + 1]) -
+                    std::min(std::min(low[c - 1], low[c]), low[c + 1]);
+
+      int * pixel = image.data() + (std::size_t) row * width;
+      for (int col = 0; col < width; col++) {
+        int c = source_cols[col];
+        if ((c >= 0) && (spread[c] <= tolerance)) pixel[col] = middle[c];
+      }
+    }
+  }, exec);
+  return image;
+}
+
+// Iteration counts of a frame, rendered in blocks of rows in parallel
+// through exec. Only the pixels of image below 0 are computed when it is
+// given.
+std::vector<int> render_frame(int width, int height, double poi_x, double poi_y,
+  double zoom, const std::string& engine, const grppi::dynamic_execution& exec,
+  std::vector<int> image = {})
+{
+  // deep zoom: pixels are iterated as offsets from the orbit of the
+  // point of interest, computed in high precision for every frame
+  std::vector<std::complex<double>> orbit;
+  if (engine == "perturbation") orbit = reference_orbit(poi_x, poi_y);
+
+  if (image.empty()) image.assign((std::size_t) width * height, -1);
+  int blocks = (height + frame_block_rows - 1) / frame_block_rows;
+  map_index(blocks, [&](int block) {
+    int last = std::min(height, (block + 1) * frame_block_rows);
+    for(auto row = block * frame_block_rows; row < last; ++row){
+      for(auto col = 0; col < width; ++col){
+        auto & pixel = image[(std::size_t) row * width + col];
+        if (pixel >= 0) continue;
+        if (!orbit.empty()) {
+          std::complex<double>
+            delta{ (col - width / 2.0) * zoom, (row - height / 2.0) * zoom };
+          pixel = perturbed_pixel(delta, orbit);
+          continue;
+        }
+        std::complex<double> 
+          c{ col * zoom + (poi_x - ((width  / 2.0) * zoom)),
+             row * zoom + (poi_y - ((height / 2.0) * zoom)) };
+        pixel = mandelbrot_pixel(c);
+      }
+    }
+  }, exec);
+  return image;
+}
+
+// Plays the zoom with a pipeline: a generator of frame zooms, a farm that
+// renders several frames at once, a stage that puts the rendered frames
+// back in order and a display stage. Only the display is throttled to 30
+// frames per second, so rendering runs ahead of it by up to
+// 2*nr_workers frames, or fewer if their counts would not fit in
+// frame_memory_budget. Reusing counts chains every frame to the previous
+// one, so the farm then has a single worker, which reprojects and renders
+// each frame in blocks of rows through exec instead. The y4m and rgb displays
+// stream raw video through a frame_writer instead of drawing text.
+void mandelbrot(int width, int height, const video_options& options,
   const grppi::dynamic_execution& exec)
 {
   double poi_x = -0.0452407411, 
@@ -72,34 +481,143 @@ void mandelbrot(int width, int height,
   std::vector<time_point<system_clock>> frame_times(11);
   int frames= 0, current= 0, generated_frames = 0;
 
+  int nr_workers = std::max(1, (int) std::thread::hardware_concurrency());
+  // frames of the farm are rendered whole by each worker unless they are
+  // chained by reuse
+  grppi::dynamic_execution serial{grppi::sequential_execution{}};
+  const grppi::dynamic_execution & frame_exec = options.reuse ? exec : serial;
+  std::size_t frame_bytes = (std::size_t) width * height * sizeof(int);
+  in_flight_limit limit{(int) std::max<std::size_t>(1,
+    std::min<std::size_t>(2 * nr_workers, frame_memory_budget / frame_bytes))};
+  std::map<int, video_frame> pending;
+  int next_shown = 0;
+  frame_encoder encoder{options.display == "delta"};
+  std::vector<int> previous;
+  double previous_zoom = 0;
+  std::size_t pixels = 0, reused = 0, wrong = 0;
+  int max_error = 0;
+  std::vector<double> latencies;
+  time_point<system_clock> first_shown;
+
+  bool raw = (options.display == "y4m") || (options.display == "rgb");
+  bool discard = options.headless && options.output.empty();
+  bool to_file = options.headless && !discard && (options.output != "-");
+  std::ostream & report = (options.output == "-") ? std::cerr : std::cout;
+
+  std::ofstream file;
+  if (to_file && !raw) {
+    file.open(options.output, std::ofstream::binary);
+    if (!file.is_open()) {
+      std::cerr << "Error: can't open file " << options.output << std::endl;
+      std::exit(-1);
+    }
+  }
+  std::ostream & out = to_file ? file : std::cout;
+
+  video_encoder video{options.display == "y4m", width, height};
+  std::vector<unsigned char> scratch;
+  int fd = -1;
+  std::unique_ptr<frame_writer> writer;
+  if (raw && !discard) {
+    fd = to_file ? open(options.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                 : STDOUT_FILENO;
+    if (fd < 0) {
+      std::cerr << "Error: can't create file " << options.output << std::endl;
+      std::exit(-1);
+    }
+    writer.reset(new frame_writer{fd, options.output});
+  }
+
   next = system_clock::now();
   init = next;
-  std::cout << "\033[2J";
+  if (!discard && !raw) out << "\033[2J";
 
   // ****** GRPPI code must be placed from here ***** //
-  while (!finalize && generated_frames++ <= max_frames) {
-    // make no more than 30 frames per second
-    std::this_thread::sleep_for(milliseconds(1000/30));
-    zoom-= zoom * 0.01;
-
-    std::stringstream image;
-    for(auto row = 0; row < height; ++row){
-      for(auto col = 0; col < width; ++col){
-        std::complex<double> 
-          c{ col * zoom + (poi_x - ((width  / 2.0) * zoom)),
-             row * zoom + (poi_y - ((height / 2.0) * zoom)) };
-        image << get_color( mandelbrot_pixel(c) );
+  grppi::pipeline(exec,
+    [&]() -> std::experimental::optional<video_frame> {
+      if (finalize || generated_frames >= options.frames) return {};
+      limit.acquire();
+      zoom-= zoom * 0.01;
+      return video_frame{ generated_frames++, zoom, system_clock::now(), {} };
+    },
+    grppi::farm(options.reuse ? 1 : nr_workers, [&](video_frame frame) {
+      if (previous.empty()) {
+        frame.iterations =
+          render_frame(width, height, poi_x, poi_y, frame.zoom, options.engine,
+                       frame_exec);
       }
-      image << "\n";
-    }
-    std::string im = image.str();
+      else {
+        auto image = reproject(previous, width, height, previous_zoom, frame.zoom,
+                               options.tolerance, frame_exec);
+        pixels += image.size();
+        reused += std::count_if(image.begin(), image.end(), [](int n) { return n >= 0; });
+        frame.iterations = render_frame(width, height, poi_x, poi_y, frame.zoom,
+                                        options.engine, frame_exec, std::move(image));
+        if (options.validate) {
+          auto exact = render_frame(width, height, poi_x, poi_y, frame.zoom,
+                                    options.engine, frame_exec);
+          for (std::size_t i = 0; i < exact.size(); i++) {
+            int error = std::abs(exact[i] - frame.iterations[i]);
+            wrong += (error > 0);
+            max_error = std::max(max_error, error);
+          }
+        }
+      }
+      if (options.reuse) {
+        previous = frame.iterations;
+        previous_zoom = frame.zoom;
+      }
+      return frame;
+    }),
+    [&](video_frame frame) {
+      std::vector<video_frame> ready;
+      pending.emplace(frame.index, std::move(frame));
+      for (auto it = pending.begin();
+           (it != pending.end()) && (it->first == next_shown);
+           it = pending.erase(it), next_shown++)
+        ready.push_back(std::move(it->second));
+      return ready;
+    },
+    [&](std::vector<video_frame> ready) {
+      for (auto & frame : ready) {
+        // show no more than 30 frames per second
+        if (!options.headless) std::this_thread::sleep_until(next + milliseconds(1000/30));
+        if (raw) {
+          if (writer) {
+            video.encode(frame.iterations, writer->next());
+            writer->submit();
+          }
+          else video.encode(frame.iterations, scratch);
+        }
+        else {
+          auto & image = encoder.encode(frame.iterations, width, height);
+          auto stats = get_stats(next, system_clock::now(), 
+                         init, frame_times, current, frames);
+          if (!discard) {
+            out << stats;
+            out.write(image.data(), image.size());
+            if (!options.headless) out << std::flush;
+          }
+        }
+        next = system_clock::now();
+        if (latencies.empty()) first_shown = next;
+        latencies.push_back(duration<double, std::milli>(next - frame.created).count());
+        limit.release();
+      }
+    });
+  // ****** to here ***** //
+
+  writer.reset();
+  if (to_file && raw) close(fd);
 
-    std::cout << get_stats(next, system_clock::now(), 
-                 init, frame_times, current, frames)
-              << im << std::flush;
-    next = system_clock::now();
+  report << "\n" << get_summary(latencies, first_shown, next);
+  if (pixels > 0) {
+    report << "Reprojected: " << 100.0 * reused / pixels << "% of the pixels"
+              << std::endl;
+    if (options.validate)
+      report << "Validation: " << 100.0 * wrong / pixels << "% of the pixels differ,"
+                << " by up to " << max_error << " iterations" << std::endl;
   }
-  // ****** to here ***** //
 }
 
 grppi::dynamic_execution execution_mode(const std::string & opt) 
@@ -122,13 +640,160 @@ double mandelbrot_pixel(std::complex<double> start)
   return iterations;
 }
 
-std::string get_color(double iterations) 
+// Signed fixed-point number of 32 integer bits and 32 * Fraction fraction
+// bits, stored in two's complement from the most significant limb. 128
+// fraction bits keep the reference orbits exact to well beyond the pixel
+// size after max_frames zoom steps.
+template <int Fraction>
+struct wide_fixed {
+  std::array<std::uint32_t, Fraction + 1> limb{};
+
+  explicit wide_fixed(double value = 0)
+  {
+    double magnitude = std::fabs(value);
+    for (auto & l : limb) {
+      l = (std::uint32_t) std::floor(magnitude);
+      magnitude = (magnitude - l) * 4294967296.0;
+    }
+    if (value < 0) *this = -*this;
+  }
+
+  bool negative() const { return limb[0] >> 31; }
+
+  double to_double() const
+  {
+    wide_fixed magnitude = negative() ? -*this : *this;
+    double value = 0;
+    for (int i = Fraction; i >= 0; i--) value = value / 4294967296.0 + magnitude.limb[i];
+    return negative() ? -value : value;
+  }
+
+  wide_fixed operator-() const
+  {
+    wide_fixed result;
+    std::uint64_t carry = 1;
+    for (int i = Fraction; i >= 0; i--) {
+      carry += (std::uint32_t) ~limb[i];
+      result.limb[i] = (std::uint32_t) carry;
+      carry >>= 32;
+    }
+    return result;
+  }
+
+  wide_fixed operator+(const wide_fixed& other) const
+  {
+    wide_fixed result;
+    std::uint64_t carry = 0;
+    for (int i = Fraction; i >= 0; i--) {
+      carry += (std::uint64_t) limb[i] + other.limb[i];
+      result.limb[i] = (std::uint32_t) carry;
+      carry >>= 32;
+    }
+    return result;
+  }
+
+  wide_fixed operator-(const wide_fixed& other) const { return *this + -other; }
+
+  // product truncated to Fraction fraction limbs
+  wide_fixed operator*(const wide_fixed& other) const
+  {
+    wide_fixed a = negative() ? -*this : *this,
+               b = other.negative() ? -other : other;
+    std::array<std::uint64_t, 2 * Fraction + 2> column{};
+    for (int i = 0; i <= Fraction; i++) {
+      for (int j = 0; j <= Fraction; j++) {
+        std::uint64_t product = (std::uint64_t) a.limb[i] * b.limb[j];
+        column[i + j + 1] += (std::uint32_t) product;
+        column[i + j] += product >> 32;
+      }
+    }
+    for (int k = 2 * Fraction + 1; k > 0; k--) {
+      column[k - 1] += column[k] >> 32;
+      column[k] &= 0xffffffff;
+    }
+    wide_fixed result;
+    for (int k = 0; k <= Fraction; k++) result.limb[k] = (std::uint32_t) column[k + 1];
+    return (negative() != other.negative()) ? -result : result;
+  }
+};
+
+// Orbit Z(n+1) = Z(n)^2 + C of the reference point C = (re, im), iterated
+// in fixed point and stored in double until it escapes or reaches
+// max_iteration
+std::vector<std::complex<double>> reference_orbit(double re, double im)
+{
+  using number = wide_fixed<4>;
+  number c_re{re}, c_im{im}, z_re, z_im;
+  std::vector<std::complex<double>> orbit{ {0, 0} };
+  orbit.reserve(max_iteration + 1);
+  while ((int) orbit.size() <= max_iteration) {
+    number re2 = z_re * z_re, im2 = z_im * z_im, cross = z_re * z_im;
+    z_re = re2 - im2 + c_re;
+    z_im = cross + cross + c_im;
+    orbit.emplace_back(z_re.to_double(), z_im.to_double());
+    if (std::norm(orbit.back()) >= 4) break;
+  }
+  return orbit;
+}
+
+// Iterations of mandelbrot_pixel for the point C + delta, given the orbit of
+// the reference C. Only the offset dz(n) = z(n) - Z(n) is iterated, as
+// dz(n+1) = (2 Z(n) + dz(n)) dz(n) + delta, which double keeps accurate for
+// the tiny deltas of deep zooms. When the pixel orbit gets closer to 0 than
+// to the reference (where the offset would lose its precision and glitch)
+// or the reference runs out, the pixel is rebased to the start of the
+// reference, whose Z(0) is 0, so its offset becomes the whole z.
+double perturbed_pixel(std::complex<double> delta,
+  const std::vector<std::complex<double>>& orbit)
+{
+  int iterations = 0, reference = 0, last = orbit.size() - 1;
+  std::complex<double> dz, z;
+  while (std::norm(z) < 4 && ++iterations < max_iteration) {
+    dz = (2.0 * orbit[reference] + dz) * dz + delta;
+    z = orbit[++reference] + dz;
+    if ((std::norm(z) < std::norm(dz)) || (reference == last)) {
+      dz = z;
+      reference = 0;
+    }
+  }
+  return iterations;
+}
+
+// Colour of the mandelbrot image for an iteration count
+rgb get_rgb(int iterations)
+{
+    iterations = (iterations*127)/max_iteration;
+    int r, g, b;
+
+    if (iterations == 0) {
+        r = 255;
+        g = 0;
+        b = 0;
+    } else if (iterations < 16) {
+        r = 16 * (16 - iterations);
+        g = 0;
+        b = 16 * iterations - 1;
+    } else if (iterations < 32) {
+        r = 0;
+        g = 16 * (iterations - 16);
+        b = 16 * (32 - iterations) - 1;
+    } else if (iterations < 64) {
+        r = 8 * (iterations - 32);
+        g = 8 * (64 - iterations) - 1;
+        b = 0;
+    } else { // range is 64 - 127
+        r = 255 - (iterations - 64) * 4;
+        g = 0;
+        b = 0;
+    }
+    return rgb{(unsigned char)r, (unsigned char)g, (unsigned char)b};
+}
+
+cell get_color(double iterations) 
 {
     iterations = 1 - iterations / (double) max_iteration;
-    std::string color_{ color[(int)(iterations*(70*3))/70] },
-                ascii_{ ascii_map[(int)(iterations*(70*3))%70] },
-                end_{ "\033[0m" };
-    return color_ + ascii_ + end_;
+    int shade = std::min((int)(iterations*(70*3)), 70*3 - 1);
+    return cell{ (unsigned char)(shade/70), ascii_map[shade%70] };
 }
 
 std::string get_stats(
@@ -156,7 +821,7 @@ std::string get_stats(
           execution_time= (duration_cast<milliseconds>(end-init).count()/1000.0);
 
   std::stringstream s;
-  s << "\033[2J\033[1;1H" 
+  s << "\033[1;1H" 
     << "[ FPS: " << std::left 
                  << std::setw(6) 
                  << std::setprecision(5) 
@@ -173,25 +838,107 @@ std::string get_stats(
                  << std::setw(7)
                  << std::setprecision(6) 
                  << execution_time 
-    << "]\n";
+    << "]\033[K\n";
+  return s.str();
+}
+
+// Distribution of the latencies of the frames, from their generation to
+// their display, and the frame rate sustained from the first frame shown
+// to the last
+std::string get_summary(std::vector<double> latencies,
+  time_point<system_clock> first, time_point<system_clock> last)
+{
+  std::stringstream s;
+  s << "Frames: " << latencies.size();
+  if (latencies.size() > 1)
+    s << ", sustained FPS: " << std::setprecision(5)
+      << (latencies.size() - 1) / duration<double>(last - first).count();
+  s << "\n";
+  if (latencies.empty()) return s.str();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    std::size_t rank = std::ceil(p / 100 * latencies.size());
+    return latencies[std::max<std::size_t>(rank, 1) - 1];
+  };
+  s << "Frame latency (ms): p50 " << std::setprecision(4) << percentile(50)
+    << ", p95 " << percentile(95) << ", p99 " << percentile(99)
+    << ", max " << latencies.back() << "\n";
   return s.str();
 }
 
 int main (int argc, char *argv[])
 {
-  if(argc != 2){
+  if((argc < 2 || argc > 9) || (argc == 6 || argc == 7)){
     std::cout << "Usage: " << argv[0] 
-              << " mode" << std::endl;
+              << " mode [engine [display [reuse [width height frames [output]]]]]"
+              << std::endl
+              << "  engine: double, or perturbation for deep zooms"
+              << " (default double)" << std::endl
+              << "  display: full, delta to redraw only the changed cells,"
+              << " or y4m or rgb raw video of a headless run (default full)"
+              << std::endl
+              << "  reuse: none, on[:tolerance] to reproject the counts of the"
+              << " previous frame, or validate[:tolerance] to also measure"
+              << " their error (default none)" << std::endl
+              << "  width height frames: run headless, without pacing, writing"
+              << " the frames to output, - for the standard output, or"
+              << " discarding them" << std::endl;
+    return -1;
+  }
+  video_options options;
+  options.engine = argc >= 3 ? argv[2] : "double";
+  std::string display{argc >= 4 ? argv[3] : "full"};
+  std::string reuse{argc >= 5 ? argv[4] : "none"};
+  if (std::find(engines.begin(), engines.end(), options.engine) == engines.end()) {
+    std::cerr << "Error: unknown engine " << options.engine << std::endl;
+    return -1;
+  }
+  if (std::find(displays.begin(), displays.end(), display) == displays.end()) {
+    std::cerr << "Error: unknown display " << display << std::endl;
+    return -1;
+  }
+  options.display = display;
+  std::string reuse_mode = reuse.substr(0, reuse.find(':'));
+  if ((reuse_mode != "none") && (reuse_mode != "on") && (reuse_mode != "validate")) {
+    std::cerr << "Error: unknown reuse " << reuse << std::endl;
+    return -1;
+  }
+  options.reuse = (reuse_mode != "none");
+  options.validate = (reuse_mode == "validate");
+  if (reuse.find(':') != std::string::npos)
+    options.tolerance = std::stoi(reuse.substr(reuse.find(':') + 1));
+  if (options.tolerance < 0) {
+    std::cerr << "Error: reuse tolerance should not be negative" << std::endl;
     return -1;
   }
   signal(SIGINT, signal_callback_handler);
 
   auto exec = execution_mode(argv[1]);
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-  int width = w.ws_col - 3, height = w.ws_row - 3;
+  int width, height;
+  if (argc >= 8) {
+    options.headless = true;
+    width = std::stoi(argv[5]);
+    height = std::stoi(argv[6]);
+    options.frames = std::stoi(argv[7]);
+    if (argc == 9) options.output = argv[8];
+    if ((width < 1) || (height < 1) || (options.frames < 1)) {
+      std::cerr << "Error: width, height and frames should be positive" << std::endl;
+      return -1;
+    }
+  }
+  else if ((display == "y4m") || (display == "rgb")) {
+    std::cerr << "Error: raw video needs width, height and frames" << std::endl;
+    return -1;
+  }
+  else {
+    struct winsize w;
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    width = w.ws_col - 3;
+    height = w.ws_row - 3;
+  }
 
-  mandelbrot(width, height, exec);
+  mandelbrot(width, height, options, exec);
 
   return 0;
 }